@@ -1,25 +1,39 @@
 #include <Arduino.h>
 #include "../src/CommandStation.h"
 
-volatile DCC* mainTrack = DCC::Create_WSM_SAMCommandStation_Main(50);
-volatile DCC* progTrack = DCC::Create_WSM_SAMCommandStation_Prog(2);
+DCCMain* mainTrack = DCCMain::Create_WSM_FireBox_Main(50);
+DCCService* progTrack = DCCService::Create_WSM_FireBox_Prog();
 
-void setup() {
-	CommManager::registerInterface(new SerialInterface(SerialUSB));
-	StringParser::init(mainTrack, progTrack);
-	CommManager::showInitInfo();
+// Generates the signal on both tracks, every 29us
+void waveform_IrqHandler() {
+	mainTrack->interruptHandler();
+	progTrack->interruptHandler();
 }
 
-void loop() {
-  	CommManager::update();
-	mainTrack->check();
-	progTrack->check();
+// Railcom bytes come in on SERCOM4 during the cutout. The FireBox preset 
+// needs this, or no railcom data is received.
+void SERCOM4_Handler() {
+	mainTrack->railcom.rxInterruptHandler();
 }
 
-void TCC0_Handler() {
-	mainTrack->interrupt_handler();
+void setup() {
+	mainTrack->setup();
+	progTrack->setup();
+
+	// TimerA is TCC0 on the SAMD21
+	TimerA.initialize();
+	TimerA.setPeriod(29);
+	TimerA.attachInterrupt(waveform_IrqHandler);
+	TimerA.start();
+
+	CommManager::registerInterface(new USBInterface(SerialUSB));
+	DCCEXParser::init(mainTrack, progTrack);
+	EEStore::init();
+	CommManager::showInitInfo();
 }
 
-void TCC1_Handler() {
-	progTrack->interrupt_handler();
-}
\ No newline at end of file
+void loop() {
+	CommManager::update();
+	mainTrack->loop();
+	progTrack->loop();
+}
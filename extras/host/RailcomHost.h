@@ -0,0 +1,69 @@
+/*
+ *  RailcomHost.h
+ *
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDSTATION_EXTRAS_HOST_RAILCOMHOST_H_
+#define COMMANDSTATION_EXTRAS_HOST_RAILCOMHOST_H_
+
+#include "../../src/DCC/Railcom.h"
+
+// Feeds captures to a Railcom without a cutout, for the host checks. The
+// captures reach the POM, logon and location tables as if they had come in
+// from the track.
+class RailcomHost {
+public:
+  // Decodes a capture straight away, as if it had just come in.
+  static void replay(Railcom& railcom, const RailcomCapture& capture) {
+    RailcomCapture copy = capture;
+    if(copy.count > 8) copy.count = 8;
+    railcom.processCapture(copy);
+  }
+
+  // Decodes count random captures and returns the microseconds spent in the
+  // decoder.
+  static uint32_t fuzz(Railcom& railcom, uint16_t count) {
+    uint32_t elapsed = 0;
+
+    for(uint16_t n = 0; n < count; n++) {
+      RailcomCapture capture;
+      capture.count = random(0, 9);
+      capture.type = (PacketType)random(kResetType, kSrvcReadType + 1);
+      capture.address = random(0, 0x10000);
+      capture.transmitID = random(1, 0x10000);
+      capture.timestamp = micros();
+
+      // Mostly valid 4/8 codes, so the decode gets past the validity check
+      // often enough to reach the datagram handling
+      for(uint8_t i = 0; i < 8; i++) {
+        uint8_t b = random(0, 256);
+        if(random(0, 8) != 0) {
+          while(railcom_decode[b] >= 0x40) b = random(0, 256);
+        }
+        capture.data[i] = b;
+      }
+
+      uint32_t start = micros();
+      railcom.processCapture(capture);
+      elapsed += micros() - start;
+    }
+
+    return elapsed;
+  }
+};
+
+#endif  // COMMANDSTATION_EXTRAS_HOST_RAILCOMHOST_H_
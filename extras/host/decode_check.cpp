@@ -0,0 +1,94 @@
+/*
+ *  decode_check.cpp
+ *
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks Railcom::decode() against the railcom_decode table for all 256 byte
+// values, in every position and with every byte count from 0 to 8. decode()
+// works out its masks from bit tricks on the table values, so this compares
+// them with the plain reading of the table.
+//
+//   decode_check          exits non-zero if any mask or symbol differs
+
+#include <stdio.h>
+
+#include "../../src/DCC/Railcom.h"
+
+static unsigned long checked = 0;
+static unsigned long failed = 0;
+
+static bool isSpecial(uint8_t v) {
+  return v == INV || v == ACK || v == NACK || v == BUSY || v == RESVD1 ||
+    v == RESVD2 || v == RESVD3;
+}
+
+static void check(const uint8_t raw[], uint8_t count) {
+  RailcomSymbols out;
+  Railcom::decode(raw, count, out);
+
+  RailcomSymbols expected = {};
+  for(uint8_t i = 0; i < count; i++) {
+    uint8_t v = railcom_decode[raw[i]];
+    expected.symbols[i] = v;
+    expected.received |= 1 << i;
+    if(v < 0x40) expected.data |= 1 << i;
+    if(v == ACK || v == NACK || v == BUSY) expected.reply |= 1 << i;
+  }
+
+  checked++;
+  bool same = out.received == expected.received &&
+    out.data == expected.data && out.reply == expected.reply;
+  for(uint8_t i = 0; i < 8; i++)
+    same = same && out.symbols[i] == expected.symbols[i];
+  if(same) return;
+
+  if(failed++ < 10) {
+    printf("count %u bytes", count);
+    for(uint8_t i = 0; i < 8; i++) printf(" %02X", raw[i]);
+    printf(": received %02X data %02X reply %02X, expected %02X %02X %02X\n",
+      out.received, out.data, out.reply, expected.received, expected.data,
+      expected.reply);
+  }
+}
+
+int main() {
+  // decode() relies on every value being data or one of the specials
+  for(int b = 0; b < 256; b++) {
+    uint8_t v = railcom_decode[b];
+    checked++;
+    if(v < 0x40 || isSpecial(v)) continue;
+    failed++;
+    printf("railcom_decode[%02X] is %02X\n", b, v);
+  }
+
+  // Each value in each position, with the other bytes taken from a data
+  // byte, ACK and INV in turn
+  const uint8_t fills[] = { 0xAC, 0xF0, 0x00 };
+  for(uint8_t f = 0; f < sizeof(fills); f++) {
+    for(int b = 0; b < 256; b++) {
+      for(uint8_t pos = 0; pos < 8; pos++) {
+        uint8_t raw[8];
+        for(uint8_t i = 0; i < 8; i++) raw[i] = fills[f];
+        raw[pos] = b;
+        for(uint8_t count = 0; count <= 8; count++) check(raw, count);
+      }
+    }
+  }
+
+  printf("checked %lu failed %lu\n", checked, failed);
+  return failed != 0;
+}
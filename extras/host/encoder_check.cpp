@@ -0,0 +1,220 @@
+/*
+ *  encoder_check.cpp
+ *
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks each instruction descriptor in PacketEncoder.h against the bytes
+// DCCMain built by hand before the descriptors existed, for every loco
+// address and every value the instruction takes. Also checks the packet type
+// and repeats each descriptor is sent with, and times encode() for a rough
+// idea of its cost.
+//
+//   encoder_check         exits non-zero if any packet differs
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../../src/DCC/PacketEncoder.h"
+
+static unsigned long checked = 0;
+static unsigned long failed = 0;
+
+// The old code, a packet built by hand less the checksum
+struct Reference {
+  uint8_t b[kPacketMaxSize];
+  uint8_t nB;
+  uint16_t railcomAddr;
+};
+
+static void referenceAddress(uint16_t addr, Reference& r) {
+  r.nB = 0;
+  r.railcomAddr = 0;
+
+  if(addr > 127) {
+    r.b[r.nB++] = highByte(addr) | 0xC0;    // convert address to packet format
+    r.railcomAddr = (highByte(addr) | 0xC0) << 8;
+  }
+
+  r.b[r.nB++] = lowByte(addr);
+  r.railcomAddr |= lowByte(addr);
+}
+
+static void referenceSpeed(uint16_t addr, int speed, uint8_t direction,
+  Reference& r) {
+  referenceAddress(addr, r);
+  r.b[r.nB++] = 0x3F;   // 128-step speed control byte
+  if(speed >= 0) r.b[r.nB++] = speed + (speed > 0) + direction * 128;
+  else r.b[r.nB++] = 1;
+}
+
+static void referenceFunction(uint16_t addr, uint8_t byte1, Reference& r) {
+  referenceAddress(addr, r);
+  r.b[r.nB++] = (byte1 | 0x80) & 0xBF;
+}
+
+static void referenceFunction(uint16_t addr, uint8_t byte1, uint8_t byte2,
+  Reference& r) {
+  referenceAddress(addr, r);
+  r.b[r.nB++] = (byte1 | 0xDE) & 0xDF;
+  r.b[r.nB++] = byte2;
+}
+
+static void referencePOM(uint16_t addr, uint8_t opcode, uint16_t cv,
+  int value, Reference& r) {
+  referenceAddress(addr, r);
+  r.b[r.nB++] = opcode + (highByte(cv) & 0x03);
+  r.b[r.nB++] = lowByte(cv);
+  if(value >= 0) r.b[r.nB++] = value;
+}
+
+template<class T>
+static void compare(const char* name, uint16_t addr, const T& instruction,
+  const Reference& r) {
+  uint8_t b[kPacketMaxSize];
+  uint16_t railcomAddr;
+  memset(b, 0xAA, sizeof(b));
+  uint8_t nB = PacketEncoder::encode(addr, instruction, b, railcomAddr);
+
+  checked++;
+  if(nB == r.nB && railcomAddr == r.railcomAddr && memcmp(b, r.b, nB) == 0)
+    return;
+
+  if(failed++ < 10) {
+    printf("%s address %u:", name, addr);
+    for(uint8_t i = 0; i < nB; i++) printf(" %02X", b[i]);
+    printf(" (%04X), was", railcomAddr);
+    for(uint8_t i = 0; i < r.nB; i++) printf(" %02X", r.b[i]);
+    printf(" (%04X)\n", r.railcomAddr);
+  }
+}
+
+template<class T>
+static void checkSent(const char* name, PacketType type, uint8_t repeats) {
+  checked++;
+  if(T::type == type && T::repeats == repeats) return;
+  failed++;
+  printf("%s sent as type %d repeats %u, was type %d repeats %u\n", name,
+    T::type, T::repeats, type, repeats);
+}
+
+static void checkAddress(uint16_t addr) {
+  Reference r;
+
+  for(int speed = 0; speed <= 126; speed++) {
+    for(uint8_t direction = 0; direction <= 1; direction++) {
+      SpeedInstruction instruction;
+      instruction.speed = speed;
+      instruction.direction = direction;
+      referenceSpeed(addr, speed, direction, r);
+      compare("speed", addr, instruction, r);
+    }
+  }
+  EmergencyStopInstruction stop;
+  referenceSpeed(addr, -1, 0, r);
+  compare("emergency stop", addr, stop, r);
+
+  for(int byte1 = 0; byte1 <= 0xFF; byte1++) {
+    FunctionGroupInstruction group;
+    group.byte1 = byte1;
+    referenceFunction(addr, byte1, r);
+    compare("function group", addr, group, r);
+
+    // 0xD8-0xDC were folded into 0xDE/0xDF before F29-F68 were added
+    if(byte1 >= 0xD8 && byte1 <= 0xDC) continue;
+    FunctionExpansionInstruction expansion;
+    expansion.byte1 = byte1;
+    expansion.byte2 = byte1 ^ 0x5A;
+    referenceFunction(addr, byte1, byte1 ^ 0x5A, r);
+    compare("function expansion", addr, expansion, r);
+  }
+
+  // Zero based CVs, including ones past 1023 that wrap
+  for(uint16_t cv = 0; cv < 1100; cv += 7) {
+    POMWriteByteInstruction writeByte;
+    writeByte.cv = cv;
+    writeByte.value = cv & 0xFF;
+    referencePOM(addr, 0xEC, cv, cv & 0xFF, r);
+    compare("POM write byte", addr, writeByte, r);
+
+    for(uint8_t bit = 0; bit < 16; bit++) {
+      POMWriteBitInstruction writeBit;
+      writeBit.cv = cv;
+      writeBit.value = 0xF0 + ((bit >> 3) * 8) + (bit & 0x07);
+      referencePOM(addr, 0xE8, cv, writeBit.value, r);
+      compare("POM write bit", addr, writeBit, r);
+    }
+
+    POMReadByteInstruction readByte;
+    readByte.cv = cv;
+    readByte.value = 0;
+    referencePOM(addr, 0xE4, cv, 0, r);
+    compare("POM read byte", addr, readByte, r);
+
+    POMReadBytesInstruction readBytes;
+    readBytes.cv = cv;
+    referencePOM(addr, 0xE0, cv, -1, r);
+    compare("POM read bytes", addr, readBytes, r);
+  }
+}
+
+// Encodes a mix of instructions to long and short addresses
+static void benchmark(unsigned long count) {
+  uint8_t b[kPacketMaxSize];
+  uint16_t railcomAddr;
+  unsigned long sum = 0;
+
+  unsigned long start = micros();
+  for(unsigned long i = 0; i < count; i++) {
+    uint16_t addr = (i & 1) ? 3 : 1234;
+    SpeedInstruction speed;
+    speed.speed = i & 0x7F;
+    speed.direction = (i >> 7) & 1;
+    sum += PacketEncoder::encode(addr, speed, b, railcomAddr) + b[1];
+    FunctionGroupInstruction group;
+    group.byte1 = i & 0xFF;
+    sum += PacketEncoder::encode(addr, group, b, railcomAddr) + b[1];
+    POMWriteByteInstruction pom;
+    pom.cv = i & 0x3FF;
+    pom.value = i & 0xFF;
+    sum += PacketEncoder::encode(addr, pom, b, railcomAddr) + b[2];
+  }
+  unsigned long elapsed = micros() - start;
+
+  printf("encoded %lu packets in %lu us (%lu)\n", count * 3, elapsed,
+    sum & 0xFF);
+}
+
+int main() {
+  checkSent<SpeedInstruction>("speed", kThrottleType, 0);
+  // Emergency stops are sent twice since they got their own fast path
+  checkSent<EmergencyStopInstruction>("emergency stop", kThrottleType, 1);
+  checkSent<FunctionGroupInstruction>("function group", kFunctionType, 3);
+  checkSent<FunctionExpansionInstruction>("function expansion",
+    kFunctionType, 3);
+  checkSent<POMWriteByteInstruction>("POM write byte", kPOMByteWriteType, 3);
+  checkSent<POMWriteBitInstruction>("POM write bit", kPOMBitWriteType, 4);
+  checkSent<POMReadByteInstruction>("POM read byte", kPOMReadType, 3);
+  checkSent<POMReadBytesInstruction>("POM read bytes", kPOMLongReadType, 3);
+
+  for(uint16_t addr = 1; addr <= 10239; addr++) checkAddress(addr);
+
+  printf("checked %lu failed %lu\n", checked, failed);
+  if(failed != 0) return 1;
+
+  benchmark(1000000);
+  return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ *  logon_sim.cpp
+ *
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Runs DCC-A automatic logon against a population of simulated decoders on a
+// PC. DCCMain's waveform interrupt and loop() run as they would on a board,
+// on a simulated clock, and the decoders answer in the railcom cutouts
+// through the stand-in serial port. Decoders that haven't logged on answer
+// every LOGON_ENABLE they aren't backing off from, so replies collide until
+// the random backoff spreads them out.
+//
+//   logon_sim [RUNS [SEED]]   reports the discovery time for 1 to 8 decoders
+//
+// Exits non-zero if any run doesn't find every decoder.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/DCC/DCCMain.h"
+
+volatile uint8_t ADMUX, ADCSRA, ADCSRB;
+volatile uint16_t ADC;
+
+// Microseconds between waveform interrupts, and between calls to loop()
+const unsigned long kTickMicros = 29;
+const unsigned long kLoopMicros = 1000;
+// A run that takes longer than this has failed
+const unsigned long kDiscoveryTimeout = 60000000;
+// LOGON_ENABLE packets a decoder waits, at most, after an answer that didn't
+// get it an address
+const uint8_t kBackoffWindow = 8;
+
+struct SimDecoder {
+  uint16_t manufacturer;
+  uint32_t uniqueID;
+  uint16_t address;     // Zero until LOGON_ASSIGN
+  uint8_t backoff;      // LOGON_ENABLE packets to let go by
+  bool answered;        // Answered the last LOGON_ENABLE it heard
+};
+
+// Watches the packets DCCMain sends and the cutouts after them
+class DCCMainHost {
+public:
+  static void start(DCCMain& main) {
+    main.bytes_sent = 0;
+    main.bits_sent = 0;
+    main.remainingPreambles = main.hdw.getPreambles() + 1;
+    main.loadNextPacket();
+  }
+
+  // Runs one interrupt. Returns true when a cutout has just opened.
+  static bool tick(DCCMain& main) {
+    bool wasInCutout = main.inRailcomCutout;
+    main.interruptHandler();
+    // Remember the bytes of each packet, since the next one is loaded before
+    // the cutout that answers it
+    if(main.transmitID != lastID) {
+      lastID = main.transmitID;
+      lastLength = main.transmitLength;
+      for(uint8_t i = 0; i < lastLength; i++) last[i] = main.transmitPacket[i];
+      if(main.transmitType == kLogonAssignType) {
+        assignID = lastID;
+        for(uint8_t i = 0; i < lastLength; i++) assign[i] = last[i];
+      }
+    }
+    return main.inRailcomCutout && !wasInCutout;
+  }
+
+  static PacketType cutoutType(DCCMain& main) { return main.cutoutType; }
+  static uint16_t cutoutID(DCCMain& main) { return main.cutoutID; }
+
+  // The last LOGON_ASSIGN packet, less the checksum
+  static uint8_t assign[kPacketMaxSize];
+  static uint16_t assignID;
+
+private:
+  static uint16_t lastID;
+  static uint8_t lastLength;
+  static uint8_t last[kPacketMaxSize];
+};
+
+uint8_t DCCMainHost::assign[kPacketMaxSize];
+uint16_t DCCMainHost::assignID = 0;
+uint16_t DCCMainHost::lastID = 0;
+uint8_t DCCMainHost::lastLength = 0;
+uint8_t DCCMainHost::last[kPacketMaxSize];
+
+static HardwareSerial railcomSerial;
+static uint8_t encode48[64];     // 4/8 code for each six bit value
+static uint8_t found = 0;
+
+static void logonFound(const LogonDecoder&) { found++; }
+
+// The eight 4/8 coded bytes of a logon reply
+static void encodeReply(const SimDecoder& d, uint8_t b[8]) {
+  uint8_t sym[8];
+  sym[0] = (kMOB_LOGON << 2) | ((d.manufacturer >> 10) & 0x03);
+  sym[1] = (d.manufacturer >> 4) & 0x3F;
+  sym[2] = ((d.manufacturer & 0x0F) << 2) | ((d.uniqueID >> 30) & 0x03);
+  sym[3] = (d.uniqueID >> 24) & 0x3F;
+  sym[4] = (d.uniqueID >> 18) & 0x3F;
+  sym[5] = (d.uniqueID >> 12) & 0x3F;
+  sym[6] = (d.uniqueID >> 6) & 0x3F;
+  sym[7] = d.uniqueID & 0x3F;
+  for(uint8_t i = 0; i < 8; i++) b[i] = encode48[sym[i]];
+}
+
+// Answers a LOGON_ENABLE. Replies sent at once pull the same bits low, so the
+// UART sees them ANDed together.
+static void answerEnable(SimDecoder decoders[], uint8_t n) {
+  uint8_t bytes[8];
+  uint8_t replies = 0;
+  for(uint8_t i = 0; i < n; i++) {
+    SimDecoder& d = decoders[i];
+    if(d.address != 0) continue;
+    // Still waiting for an address after answering, so it wasn't heard
+    if(d.answered) {
+      d.answered = false;
+      d.backoff = random(0, kBackoffWindow);
+    }
+    if(d.backoff > 0) {
+      d.backoff--;
+      continue;
+    }
+
+    uint8_t reply[8];
+    encodeReply(d, reply);
+    for(uint8_t j = 0; j < 8; j++)
+      bytes[j] = replies == 0 ? reply[j] : bytes[j] & reply[j];
+    replies++;
+    d.answered = true;
+  }
+  if(replies > 0) railcomSerial.hostReceive(bytes, 8);
+}
+
+// Answers a LOGON_ASSIGN with ACKs in channel 2 if it's for one of ours
+static void answerAssign(SimDecoder decoders[], uint8_t n) {
+  const uint8_t* b = DCCMainHost::assign;
+  uint16_t manufacturer = ((b[1] & 0x0F) << 8) | b[2];
+  uint32_t uniqueID = ((uint32_t)b[3] << 24) | ((uint32_t)b[4] << 16) |
+    ((uint32_t)b[5] << 8) | b[6];
+  for(uint8_t i = 0; i < n; i++) {
+    SimDecoder& d = decoders[i];
+    if(d.manufacturer != manufacturer || d.uniqueID != uniqueID) continue;
+    d.address = ((b[7] & 0x3F) << 8) | b[8];
+    d.answered = false;
+    const uint8_t acks[6] = { 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0 };
+    railcomSerial.hostReceive(acks, sizeof(acks));
+  }
+}
+
+// Returns the simulated microseconds until every decoder had an address and
+// DCCMain had confirmed it, or 0 if that didn't happen
+static unsigned long discover(uint8_t n, uint16_t& collisions) {
+  SimDecoder decoders[kLogonDecoders];
+  for(uint8_t i = 0; i < n; i++) {
+    decoders[i].manufacturer = random(1, 0x1000);
+    decoders[i].uniqueID = ((uint32_t)random(0, 0x10000) << 16) |
+      random(0, 0x10000);
+    decoders[i].address = 0;
+    decoders[i].backoff = 0;
+    decoders[i].answered = false;
+  }
+
+  Hardware hdw;
+  hdw.config_setPreambleBits(16);
+  Railcom rcom;
+  rcom.config_setEnable(true);
+  rcom.config_setSerial(&railcomSerial);
+  DCCMain main(kLogonDecoders, hdw, rcom);
+
+  found = 0;
+  hostClock() = 0;
+  DCCMainHost::start(main);
+  main.startLogon(1000, logonFound);
+
+  unsigned long nextLoop = 0;
+  unsigned long finished = 0;
+  while(hostClock() < kDiscoveryTimeout && finished == 0) {
+    if(DCCMainHost::tick(main)) {
+      PacketType type = DCCMainHost::cutoutType(main);
+      if(type == kLogonEnableType) answerEnable(decoders, n);
+      else if(type == kLogonAssignType &&
+        DCCMainHost::cutoutID(main) == DCCMainHost::assignID)
+        answerAssign(decoders, n);
+    }
+    hostClock() += kTickMicros;
+
+    if(hostClock() >= nextLoop) {
+      nextLoop += kLoopMicros;
+      main.loop();
+      if(found == n) finished = hostClock();
+    }
+  }
+
+  collisions = main.railcom.getLogonCollisions();
+  for(uint8_t i = 0; i < n; i++) {
+    if(decoders[i].address == 0) finished = 0;
+  }
+  return finished;
+}
+
+int main(int argc, char** argv) {
+  int runs = argc > 1 ? atoi(argv[1]) : 20;
+  randomSeed(argc > 2 ? strtoul(argv[2], NULL, 0) : 1);
+  hostClockRunning() = false;
+
+  for(int b = 0; b < 256; b++) {
+    uint8_t v = railcom_decode[b];
+    if(v < 0x40) encode48[v] = b;
+  }
+
+  int failures = 0;
+  const uint8_t populations[] = { 1, 2, 4, 8 };
+  for(uint8_t p = 0; p < sizeof(populations); p++) {
+    uint8_t n = populations[p];
+    unsigned long total = 0;
+    unsigned long worst = 0;
+    unsigned long collisions = 0;
+    int missed = 0;
+    for(int r = 0; r < runs; r++) {
+      uint16_t c;
+      unsigned long t = discover(n, c);
+      collisions += c;
+      if(t == 0) {
+        missed++;
+        continue;
+      }
+      total += t;
+      if(t > worst) worst = t;
+    }
+    failures += missed;
+    int ok = runs - missed;
+    printf("decoders %u runs %d: average %lu ms worst %lu ms collisions %lu\n",
+      n, runs, ok > 0 ? total / ok / 1000 : 0, worst / 1000,
+      collisions / runs);
+  }
+
+  if(failures != 0) printf("%d runs didn't find every decoder\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,117 @@
+/*
+ *  railcom_replay.cpp
+ * 
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Plays railcom captures back through the decoder, or fuzzes it with random
+// ones, on a PC. Each run gets its own Railcom, so nothing here can touch a
+// command station.
+//
+//   railcom_replay FILE       replays the captures in FILE (- for stdin)
+//   railcom_replay -f N [SEED] decodes N random captures
+//
+// A capture file has one cutout per line: the packet type and address in 
+// decimal, then up to eight bytes in hex as they came from the UART. Lines 
+// starting with # are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "RailcomHost.h"
+
+static void locationChange(uint16_t addr, bool present) {
+  printf("location %u %s\n", addr, present ? "present" : "gone");
+}
+
+static void printStats(const Railcom& railcom) {
+  const RailcomDecodeStats& stats = 
+    const_cast<Railcom&>(railcom).getDecodeStats();
+  printf("captures %lu empty %lu invalid %lu replies %lu datagrams %lu\n", 
+    (unsigned long)stats.captures, (unsigned long)stats.empty, 
+    (unsigned long)stats.invalid, (unsigned long)stats.replies, 
+    (unsigned long)stats.datagrams);
+}
+
+static int replay(Railcom& railcom, FILE* in) {
+  char line[256];
+  int lineNumber = 0;
+  while(fgets(line, sizeof(line), in) != NULL) {
+    lineNumber++;
+    char* p = line;
+    while(*p == ' ' || *p == '\t') p++;
+    if(*p == '#' || *p == '\n' || *p == '\0') continue;
+
+    RailcomCapture capture = {};
+    char* end;
+    long type = strtol(p, &end, 10);
+    if(end == p || type < kResetType || type > kSrvcReadType) {
+      fprintf(stderr, "line %d: bad packet type\n", lineNumber);
+      return 1;
+    }
+    p = end;
+    capture.type = (PacketType)type;
+    capture.address = strtol(p, &end, 10);
+    if(end == p) {
+      fprintf(stderr, "line %d: no address\n", lineNumber);
+      return 1;
+    }
+    p = end;
+    for(;;) {
+      long b = strtol(p, &end, 16);
+      if(end == p) break;
+      if(capture.count == 8 || b < 0 || b > 0xFF) {
+        fprintf(stderr, "line %d: bad capture bytes\n", lineNumber);
+        return 1;
+      }
+      capture.data[capture.count++] = b;
+      p = end;
+    }
+    capture.transmitID = lineNumber;
+    capture.timestamp = micros();
+    RailcomHost::replay(railcom, capture);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  Railcom railcom;
+
+  if(argc >= 3 && strcmp(argv[1], "-f") == 0) {
+    randomSeed(argc > 3 ? strtoul(argv[3], NULL, 0) : 1);
+    uint16_t count = strtoul(argv[2], NULL, 0);
+    uint32_t elapsed = RailcomHost::fuzz(railcom, count);
+    printStats(railcom);
+    printf("decoded %u in %lu us\n", count, (unsigned long)elapsed);
+    return 0;
+  }
+
+  if(argc != 2) {
+    fprintf(stderr, "usage: %s FILE | -f COUNT [SEED]\n", argv[0]);
+    return 2;
+  }
+
+  railcom.config_setLocationCallback(locationChange);
+  FILE* in = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+  if(in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  int result = replay(railcom, in);
+  printStats(railcom);
+  return result;
+}
@@ -0,0 +1,134 @@
+/*
+ *  Arduino.h
+ * 
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Just enough of the Arduino core to build the DCC code on a PC for the host
+// checks in extras/host. Nothing here talks to hardware.
+
+#ifndef COMMANDSTATION_EXTRAS_HOST_SHIM_ARDUINO_H_
+#define COMMANDSTATION_EXTRAS_HOST_SHIM_ARDUINO_H_
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+// The DCC code picks its AVR paths, which need the fewest registers
+#define ARDUINO_ARCH_AVR 1
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define A0 14
+
+#define PROGMEM
+class __FlashStringHelper;
+#define F(x) (reinterpret_cast<const __FlashStringHelper*>(x))
+
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) \
+  ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define _BV(b) (1 << (b))
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// Simulations set hostClockRunning() false and move hostClock() on 
+// themselves, so time passes as it would on the track.
+inline bool& hostClockRunning() {
+  static bool running = true;
+  return running;
+}
+inline unsigned long& hostClock() {
+  static unsigned long now = 0;
+  return now;
+}
+
+inline unsigned long micros() {
+  using namespace std::chrono;
+  static const steady_clock::time_point start = steady_clock::now();
+  if(!hostClockRunning()) return hostClock();
+  return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+inline unsigned long millis() { return micros() / 1000; }
+
+inline void randomSeed(unsigned long seed) { srand(seed); }
+inline long random(long low, long high) {
+  if(high <= low) return low;
+  return low + (long)(((unsigned long)rand() << 16 ^ rand()) 
+    % (unsigned long)(high - low));
+}
+
+inline int analogRead(uint8_t) { return 0; }
+inline int digitalRead(uint8_t) { return 0; }
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline void pinMode(uint8_t, uint8_t) {}
+
+class HardwareSerial {
+public:
+  void begin(long) {}
+  void end() {}
+  void flush() {}
+  int available() { return received - taken; }
+  int read() { return taken < received ? rxData[taken++] : -1; }
+  size_t readBytes(uint8_t* b, size_t n) { 
+    size_t i = 0;
+    while(i < n && taken < received) b[i++] = rxData[taken++];
+    return i;
+  }
+  template<class T> size_t print(T) { return 0; }
+  template<class T> size_t println(T) { return 0; }
+
+  // Simulations put the bytes decoders send here
+  void hostReceive(const uint8_t b[], size_t n) {
+    if(taken == received) taken = received = 0;
+    while(n-- > 0 && received < sizeof(rxData)) rxData[received++] = *b++;
+  }
+
+private:
+  uint8_t rxData[16];
+  size_t received = 0;
+  size_t taken = 0;
+};
+
+#include <avr/pgmspace.h>
+
+// AVR ADC registers, only referenced by the current sensing code
+extern volatile uint8_t ADMUX, ADCSRA, ADCSRB;
+extern volatile uint16_t ADC;
+#define ADSC 6
+#define REFS0 6
+#define MUX5 3
+
+#endif  // COMMANDSTATION_EXTRAS_HOST_SHIM_ARDUINO_H_
@@ -0,0 +1,4 @@
+// Host stand-in, see Arduino.h
+#include "Arduino.h"
+
+#define digitalWrite2 digitalWrite
@@ -0,0 +1,2 @@
+// Host stand-in, see Arduino.h
+#include "Arduino.h"
@@ -0,0 +1,11 @@
+// Host stand-in for the AVR program memory helpers, see ../Arduino.h
+#ifndef COMMANDSTATION_EXTRAS_HOST_SHIM_AVR_PGMSPACE_H_
+#define COMMANDSTATION_EXTRAS_HOST_SHIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define pgm_read_byte_near(x) (*(const uint8_t*)(x))
+#define pgm_read_byte(x) (*(const uint8_t*)(x))
+#define pgm_read_word_near(x) (*(const uint16_t*)(x))
+
+#endif  // COMMANDSTATION_EXTRAS_HOST_SHIM_AVR_PGMSPACE_H_
@@ -21,7 +21,9 @@
 
 #include "Outputs.h"
 #include "Sensors.h"
+#include "Signals.h"
 #include "Turnouts.h"
+#include "../DCC/CVCache.h"
 
 #if defined(ARDUINO_ARCH_SAMD)
 #include <SparkFun_External_EEPROM.h>
@@ -54,6 +56,8 @@ void EEStore::init(){
     eeStore->data.nTurnouts=0;
     eeStore->data.nSensors=0;
     eeStore->data.nOutputs=0;
+    eeStore->data.nSignals=0;
+    eeStore->data.nCVCache=0;
     EEPROM.put(0,eeStore->data);
   }
 
@@ -61,6 +65,8 @@ void EEStore::init(){
   Turnout::load();    // load turnout definitions
   Sensor::load();     // load sensor definitions
   Output::load();     // load output definitions
+  Signal::load();     // load signal definitions
+  CVCache::load();    // load programming track CV values
 }
 
 void EEStore::clear(){
@@ -70,6 +76,8 @@ void EEStore::clear(){
   eeStore->data.nTurnouts=0;
   eeStore->data.nSensors=0;
   eeStore->data.nOutputs=0;
+  eeStore->data.nSignals=0;
+  eeStore->data.nCVCache=0;
   EEPROM.put(0,eeStore->data);
 }
 
@@ -78,6 +86,8 @@ void EEStore::store(){
   Turnout::store();
   Sensor::store();
   Output::store();
+  Signal::store();
+  CVCache::store();
   EEPROM.put(0,eeStore->data);
 }
 
@@ -30,13 +30,18 @@
 extern ExternalEEPROM EEPROM;
 #endif
 
-#define EESTORE_ID "DCC++"
+// Changed from "DCC++" when signals were added to the stored data, and from
+// "DCC+S" when the programming track CV cache was, so older layouts get 
+// cleared rather than misread.
+#define EESTORE_ID "DCC+V"
 
 struct EEStoreData{
   char id[sizeof(EESTORE_ID)];
   int nTurnouts;
   int nSensors;  
   int nOutputs;
+  int nSignals;
+  int nCVCache;
 };
 
 struct EEStore{
@@ -0,0 +1,142 @@
+/*
+ *  Signals.cpp
+ * 
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Signals.h"
+
+#include "../CommInterface/CommManager.h"
+#include "EEStore.h"
+
+#if !defined(ARDUINO_ARCH_SAMD)
+#include <EEPROM.h>
+#endif
+
+void Signal::activate(int a, DCCMain* track){
+  // the whole aspect goes out in one extended accessory packet
+  data.aspect=a;   
+  genericResponse response;
+  track->setExtendedAccessory(data.address, data.aspect, response);
+  if(num>0)
+    EEPROM.put(num,data.aspect);
+  CommManager::printf("<g %d %d>", data.id, data.aspect);
+}
+
+Signal* Signal::get(int n){
+  Signal *tt;
+  for(tt=firstSignal;tt!=NULL && tt->data.id!=n;tt=tt->nextSignal);
+  return(tt);
+}
+
+void Signal::remove(int n){
+  Signal *tt,*pp;
+  tt=firstSignal;
+  pp=tt;
+
+  for( ;tt!=NULL && tt->data.id!=n;pp=tt,tt=tt->nextSignal);
+
+  if(tt==NULL){
+    CommManager::printf("<X>");
+    return;
+  }
+
+  if(tt==firstSignal)
+    firstSignal=tt->nextSignal;
+  else
+    pp->nextSignal=tt->nextSignal;
+
+  free(tt);
+
+  CommManager::printf("<O>");
+}
+
+void Signal::show(int n){
+  Signal *tt;
+
+  if(firstSignal==NULL){
+    CommManager::printf("<X>");
+    return;
+  }
+
+  for(tt=firstSignal;tt!=NULL;tt=tt->nextSignal){
+    if(n==1) {
+    CommManager::printf("<g %d %d %d>", tt->data.id, tt->data.address, 
+      tt->data.aspect);
+    } 
+    else {
+    CommManager::printf("<g %d %d>", tt->data.id, tt->data.aspect);
+    }
+  }
+}
+
+void Signal::load(){
+  struct SignalData data;
+  Signal *tt;
+
+  for(int i=0;i<EEStore::eeStore->data.nSignals;i++){
+    EEPROM.get(EEStore::pointer(),data);
+    tt=create(data.id,data.address,data.aspect);
+    tt->num=EEStore::pointer();
+    EEStore::advance(sizeof(tt->data));
+  }
+}
+
+void Signal::store(){
+  Signal *tt;
+
+  tt=firstSignal;
+  EEStore::eeStore->data.nSignals=0;
+
+  while(tt!=NULL){
+    tt->num=EEStore::pointer();
+    EEPROM.put(EEStore::pointer(),tt->data);
+    EEStore::advance(sizeof(tt->data));
+    tt=tt->nextSignal;
+    EEStore::eeStore->data.nSignals++;
+  }
+
+}
+
+Signal *Signal::create(int id, int add, int aspect, int v){
+  Signal *tt;
+
+  if(firstSignal==NULL){
+    firstSignal=(Signal *)calloc(1,sizeof(Signal));
+    tt=firstSignal;
+  } else if((tt=get(id))==NULL){
+    tt=firstSignal;
+    while(tt->nextSignal!=NULL)
+    tt=tt->nextSignal;
+    tt->nextSignal=(Signal *)calloc(1,sizeof(Signal));
+    tt=tt->nextSignal;
+  }
+
+  if(tt==NULL){       // problem allocating memory
+    if(v==1)
+    CommManager::printf("<X>");
+    return(tt);
+  }
+
+  tt->data.id=id;
+  tt->data.address=add;
+  tt->data.aspect=aspect;
+  if(v==1)
+    CommManager::printf("<O>");
+  return(tt);
+}
+
+Signal *Signal::firstSignal=NULL;
\ No newline at end of file
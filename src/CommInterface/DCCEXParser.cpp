@@ -24,6 +24,7 @@
 #include "../Accessories/EEStore.h"
 #include "../Accessories/Outputs.h"
 #include "../Accessories/Sensors.h"
+#include "../Accessories/Signals.h"
 #include "../Accessories/Turnouts.h"
 #include "../CommandStation.h"
 #include "CommManager.h"
@@ -36,6 +37,8 @@ int DCCEXParser::p[MAX_PARAMS];
 void DCCEXParser::init(DCCMain* mainTrack_, DCCService* progTrack_) {
   mainTrack = mainTrack_;
   progTrack = progTrack_;
+  mainTrack->railcom.config_setLocationCallback(locationResponse);
+  mainTrack->railcom.config_setTelemetryCallback(telemetryResponse);
 } 
 
 int DCCEXParser::stringParser(const char *com, int result[]) {
@@ -53,7 +56,8 @@ int DCCEXParser::stringParser(const char *com, int result[]) {
     switch (state) {
     case 1: // skipping spaces before a param
       if (hot==' ') break;
-      if (hot == '\0' || hot=='>') return parameterCount;
+      // '|' separates the operations of a batch command
+      if (hot == '\0' || hot=='>' || hot=='|') return parameterCount;
       state=2;
       continue;
     case 2: // checking sign
@@ -78,6 +82,21 @@ int DCCEXParser::stringParser(const char *com, int result[]) {
   return parameterCount;
 }
 
+// Parameters that don't fit in an int, such as XPOM CV numbers, read again 
+// as 32 bits. Returns zero if the parameter is missing or negative.
+uint32_t DCCEXParser::longParameter(const char *com, uint8_t index) {
+  for(;;) {
+    while(*com == ' ') com++;
+    if(*com == '\0' || *com == '>' || *com == '|') return 0;
+    if(index-- == 0) break;
+    while(*com != ' ' && *com != '\0' && *com != '>' && *com != '|') com++;
+  }
+
+  uint32_t value = 0;
+  while(*com >= '0' && *com <= '9') value = 10 * value + (*com++ - '0');
+  return value;
+}
+
 // See documentation on DCC class for info on this section
 void DCCEXParser::parse(const char *com) {
   int numArgs = stringParser(com+1, p);
@@ -86,9 +105,13 @@ void DCCEXParser::parse(const char *com) {
   
 /***** SET ENGINE THROTTLES USING 128-STEP SPEED CONTROL ****/
 
-  case 't':       // <t REGISTER CAB SPEED DIRECTION>
+  case 't':       // <t REGISTER CAB SPEED DIRECTION [ACCEL DECEL]>
     setThrottleResponse throttleResponse;
 
+    // Optional momentum, in milliseconds per speed step
+    if(numArgs == 6)
+      mainTrack->setMomentum(p[0], p[4], p[5]);
+
     mainTrack->setThrottle(p[0], p[1], p[2], p[3], throttleResponse);
 
     CommManager::printf(F("<T %d %d %d>"), throttleResponse.device, 
@@ -96,7 +119,80 @@ void DCCEXParser::parse(const char *com) {
     
     break;
   
-/***** OPERATE ENGINE DECODER FUNCTIONS F0-F28 ****/
+/***** SEND SEVERAL THROTTLE/FUNCTION/ACCESSORY COMMANDS AT ONCE ****/
+
+  case '*': {     // <* t REGISTER CAB SPEED DIRECTION | f CAB BYTE1 ... >
+    genericResponse response;
+    batchOperation ops[kMainQueueSize];
+    uint8_t nOps = 0;
+    bool valid = true;
+    int q[MAX_PARAMS];
+
+    // Each operation is an opcode and its parameters, as for the single 
+    // commands, and operations are separated by '|'
+    for(const char *op = com+1; op != NULL && valid; ) {
+      while(*op == ' ') op++;
+      if(*op == '\0' || *op == '>') break;
+      if(nOps >= kMainQueueSize) {
+        valid = false;
+        break;
+      }
+
+      int n = stringParser(op+1, q);
+      batchOperation& b = ops[nOps++];
+      switch(*op) {
+      case 't':   // t REGISTER CAB SPEED DIRECTION
+        b.type = kThrottleType;
+        b.slot = q[0];
+        b.addr = q[1];
+        b.value1 = q[2];
+        b.value2 = q[3];
+        valid = (n == 4);
+        break;
+      case 'f':   // f CAB BYTE1 [BYTE2]
+        b.type = kFunctionType;
+        b.addr = q[0];
+        b.byteCount = (n == 2) ? 1 : 2;
+        b.value1 = q[1];
+        b.value2 = q[2];
+        valid = (n == 2 || n == 3);
+        break;
+      case 'a':   // a ADDRESS SUBADDRESS ACTIVATE
+        b.type = kAccessoryType;
+        b.addr = q[0];
+        b.value1 = q[1];
+        b.value2 = q[2];
+        valid = (n == 3);
+        break;
+      default:
+        valid = false;
+        break;
+      }
+
+      op = strchr(op, '|');
+      if(op != NULL) op++;
+    }
+
+    if(valid && mainTrack->submitBatch(ops, nOps, response) == ERR_OK)
+      CommManager::printf(F("<O>"));
+    else
+      CommManager::printf(F("<X>"));
+
+    break;
+  }
+
+/***** EMERGENCY STOP ONE OR ALL ENGINES ****/
+
+  case '!': {       // <! [CAB]>
+    genericResponse response;
+
+    // No cab stops every engine on the main track
+    mainTrack->emergencyStop(numArgs > 0 ? p[0] : 0, response);
+
+    break;
+  }
+
+/***** OPERATE ENGINE DECODER FUNCTIONS F0-F68 ****/
 
   case 'f': {       // <f CAB BYTE1 [BYTE2]>
     genericResponse response;
@@ -111,6 +207,16 @@ void DCCEXParser::parse(const char *com) {
     break;
   }
 
+/***** OPERATE ENGINE DECODER BINARY STATES ****/
+
+  case 'u': {       // <u CAB STATE VALUE>
+    genericResponse response;
+
+    mainTrack->setBinaryState(p[0], p[1], p[2], response);
+
+    break;
+  }
+
 /***** OPERATE STATIONARY ACCESSORY DECODERS  ****/
 
   case 'a': {      // <a ADDRESS SUBADDRESS ACTIVATE>        
@@ -121,6 +227,63 @@ void DCCEXParser::parse(const char *com) {
     break;
   }
   
+/***** OPERATE EXTENDED ACCESSORY DECODERS  ****/
+
+  case 'A': {      // <A ADDRESS ASPECT>
+    genericResponse response;
+
+    mainTrack->setExtendedAccessory(p[0], p[1], response);
+    
+    break;
+  }
+
+/***** CREATE/REMOVE/SHOW ADVANCED CONSISTS  ****/
+
+  case 'C': {     // <C CONSIST CAB REVERSED>
+    genericResponse response;
+    uint8_t result = ERR_OK;
+
+    switch(numArgs){
+
+    // argument is consist address followed by a cab address and one if the 
+    // cab runs reversed in the consist
+    case 3:
+      result = mainTrack->addToConsist(p[0], p[1], p[2], response);
+      break;
+
+    // argument is consist address followed by a cab address to remove
+    case 2:
+      if(mainTrack->getConsistAddress(p[1]) == p[0])
+        result = mainTrack->removeFromConsist(p[1], response);
+      else 
+        result = ERR_OUT_OF_RANGE;
+      break;
+
+    case 1:                     // argument is consist address only
+      result = mainTrack->removeConsist(p[0], response);
+      break;
+
+    case 0:                     // no arguments
+      for(int i=0;i<kMaxConsists;i++){
+        DCCMain::Consist* c = &mainTrack->consistTable[i];
+        if(c->address == 0)
+          continue;
+        for(int j=0;j<kMaxConsistMembers;j++){
+          if(c->members[j] == 0)
+            continue;
+          CommManager::printf(F("<U %d %d %d>"), c->address, c->members[j], 
+            bitRead(c->reversed, j));
+        }
+      }
+      break;
+    }
+
+    if(numArgs > 0)
+      CommManager::printf(result == ERR_OK ? F("<O>") : F("<X>"));
+
+    break;
+  }
+
 /***** CREATE/EDIT/REMOVE/SHOW & OPERATE A TURN-OUT  ****/
 
   case 'T':       // <T ID THROW>      
@@ -155,6 +318,40 @@ void DCCEXParser::parse(const char *com) {
     
     break;
   
+/***** CREATE/EDIT/REMOVE/SHOW & OPERATE A SIGNAL  ****/
+
+  case 'G':       // <G ID ASPECT>
+    Signal *g;
+
+    switch(numArgs){
+
+    // argument is string with id number of signal followed by the aspect to 
+    // show
+    case 2:   
+      g=Signal::get(p[0]);
+      if(g!=NULL)
+        g->activate(p[1], (DCCMain*) mainTrack);
+      else
+        CommManager::printf(F("<X>"));
+      break;
+
+    // argument is string with id number of signal followed by an extended 
+    // accessory address and its initial aspect
+    case 3:                     
+      Signal::create(p[0],p[1],p[2],1);
+      break;
+
+    case 1:                     // argument is a string with id number only
+      Signal::remove(p[0]);
+      break;
+
+    case 0:                    // no arguments
+      Signal::show(1);                  // verbose show
+      break;
+    }
+    
+    break;
+  
 /***** CREATE/EDIT/REMOVE/SHOW & OPERATE AN OUTPUT PIN  ****/
 
   case 'Z':       // <Z ID ACTIVATE>
@@ -224,10 +421,23 @@ void DCCEXParser::parse(const char *com) {
 
 /***** WRITE CONFIGURATION VARIABLE BYTE TO ENGINE DECODER ON MAIN TRACK  ****/
 
-  case 'w': {     // <w CAB CV VALUE>
+  case 'w': {     // <w CAB CV VALUE [VALUE VALUE VALUE]>
     genericResponse response;
 
-    mainTrack->writeCVByteMain(p[0], p[1], p[2], response, POMResponse);
+    if(numArgs > 3) {
+      // Several values go out together in one XPOM packet, and XPOM CVs go 
+      // up to 16777216, past what an int holds
+      uint8_t values[4];
+      uint8_t count = numArgs - 2;
+      if(count > 4) count = 4;
+      for(uint8_t i = 0; i < count; i++) values[i] = p[2 + i];
+      if(mainTrack->writeCVBytesXPOM(p[0], longParameter(com+1, 1), values, 
+        count, response, XPOMResponse) != ERR_OK) 
+        CommManager::printf(F("<X>"));
+    }
+    else if(mainTrack->writeCVByteMain(p[0], p[1], p[2], response, 
+      POMResponse) != ERR_OK)
+      CommManager::printf(F("<X>"));
     
     break;
   }
@@ -237,7 +447,9 @@ void DCCEXParser::parse(const char *com) {
   case 'b': {     // <b CAB CV BIT VALUE>
     genericResponse response;
 
-    mainTrack->writeCVBitMain(p[0], p[1], p[2], p[3], response, POMResponse);
+    if(mainTrack->writeCVBitMain(p[0], p[1], p[2], p[3], response, 
+      POMResponse) != ERR_OK)
+      CommManager::printf(F("<X>"));
     
     break;
   }
@@ -260,17 +472,94 @@ void DCCEXParser::parse(const char *com) {
 
 /***** READ CONFIGURATION VARIABLE BYTE FROM ENGINE DECODER ON PROG TRACK  ****/
 
-  case 'R':     // <R CV CALLBACKNUM CALLBACKSUB>        
-    progTrack->readCV(p[0], p[1], p[2], cvResponse);
+  case 'R':     // <R CV CALLBACKNUM CALLBACKSUB [HINT]>        
+    // HINT is a value the CV probably holds, which is checked before reading
+    progTrack->readCV(p[0], p[1], p[2], cvResponse, numArgs > 3 ? p[3] : -1);
 
     break;
 
+/***** QUEUE SEVERAL READS/WRITES ON PROG TRACK ****/
+
+  case 'J': {     // <J R CV CALLBACKNUM CALLBACKSUB | W CV VALUE ... >
+    serviceJob jobs[kServiceJobQueueSize];
+    uint8_t nJobs = 0;
+    bool valid = true;
+    int q[MAX_PARAMS];
+
+    const char *op = com+1;
+    while(*op == ' ') op++;
+
+    // <J> on its own cancels the jobs that haven't started
+    if(*op == '\0') {
+      progTrack->cancelJobs();
+      CommManager::printf(F("<O>"));
+      break;
+    }
+
+    // Each job is an opcode and its parameters, as for <R>, <W> and <B>, and
+    // jobs are separated by '|'. Results come back as for the single 
+    // commands, in order.
+    while(op != NULL && valid) {
+      while(*op == ' ') op++;
+      if(*op == '\0' || *op == '>') break;
+      if(nJobs >= kServiceJobQueueSize) {
+        valid = false;
+        break;
+      }
+
+      int n = stringParser(op+1, q);
+      serviceJob& j = jobs[nJobs++];
+      switch(*op) {
+      case 'R':   // R CV CALLBACKNUM CALLBACKSUB
+        j.type = READCV;
+        j.cv = q[0];
+        j.callback = q[1];
+        j.callbackSub = q[2];
+        valid = (n == 3);
+        break;
+      case 'W':   // W CV VALUE CALLBACKNUM CALLBACKSUB
+        j.type = WRITECV;
+        j.cv = q[0];
+        j.value = q[1];
+        j.callback = q[2];
+        j.callbackSub = q[3];
+        valid = (n == 4);
+        break;
+      case 'B':   // B CV BIT VALUE CALLBACKNUM CALLBACKSUB
+        j.type = WRITECVBIT;
+        j.cv = q[0];
+        j.bitNum = q[1];
+        j.value = q[2];
+        j.callback = q[3];
+        j.callbackSub = q[4];
+        valid = (n == 5);
+        break;
+      default:
+        valid = false;
+        break;
+      }
+
+      op = strchr(op, '|');
+      if(op != NULL) op++;
+    }
+
+    if(valid && nJobs > 0 
+      && progTrack->submitJobs(jobs, nJobs, cvResponse) == ERR_OK)
+      CommManager::printf(F("<O>"));
+    else
+      CommManager::printf(F("<X>"));
+
+    break;
+  }
+
 /***** READ CONFIGURATION VARIABLE BYTE FROM RAILCOM DECODER ON MAIN TRACK ****/
 
   case 'r': {   // <r CAB CV>
     genericResponse response;
 
-    mainTrack->readCVByteMain(p[0], p[1], response, POMResponse);
+    if(mainTrack->readCVByteMain(p[0], p[1], response, POMResponse) 
+      != ERR_OK)
+      CommManager::printf(F("<X>"));
     break;
     }
 
@@ -279,9 +568,111 @@ void DCCEXParser::parse(const char *com) {
   case 'm': { // <m CAB CV>
     genericResponse response;
 
-    mainTrack->readCVBytesMain(p[0], p[1], response, POMResponse);
+    if(mainTrack->readCVBytesMain(p[0], p[1], response, POMLongResponse) 
+      != ERR_OK)
+      CommManager::printf(F("<X>"));
+    break;
+    }
+
+/***** READ 4 CONFIGURATION VARIABLE BYTES WITH AN XPOM PACKET ON MAIN  ****/
+
+  case 'x': { // <x CAB CV>
+    genericResponse response;
+
+    // XPOM CVs go up to 16777216, past what an int holds
+    if(mainTrack->readCVBytesXPOM(p[0], longParameter(com+1, 1), response, 
+      XPOMResponse) != ERR_OK)
+      CommManager::printf(F("<X>"));
+    break;
+    }
+
+/***** SHOW LOCOS DETECTED BY RAILCOM ON THE MAIN TRACK  ****/
+
+  case 'L':       // <L [CAB]>
+    if(numArgs > 0) {
+      locationResponse(p[0], mainTrack->railcom.isPresent(p[0]));
+    }
+    else {
+      uint16_t addrs[kLocationTableSize];
+      uint8_t n = mainTrack->railcom.getLocations(addrs, kLocationTableSize);
+      for(uint8_t i = 0; i < n; i++) locationResponse(addrs[i], true);
+    }
+    break;
+
+/***** SUBSCRIBE TO RAILCOM TELEMETRY FROM A LOCO ON THE MAIN TRACK  ****/
+
+  case 'V':       // <V CAB [MODE PERIOD]>
+    if(numArgs == 1) {
+      const RailcomTelemetry* telemetry = 
+        mainTrack->railcom.getTelemetry(p[0]);
+      if(telemetry == nullptr) CommManager::printf(F("<X>"));
+      else telemetryResponse(*telemetry);
+    }
+    else if(numArgs < 1 || p[1] < kTelemetryOff || p[1] > kTelemetryPeriodic 
+      || !mainTrack->railcom.subscribeTelemetry(p[0], 
+      (RailcomTelemetryMode)p[1], numArgs > 2 ? p[2] : 1000)) 
+      CommManager::printf(F("<X>"));
+    else
+      CommManager::printf(F("<O>"));
     break;
+
+/***** FIND AND ADDRESS DECODERS WITH RAILCOM AUTOMATIC LOGON  ****/
+
+  case '@':       // <@ [FIRSTADDRESS]>
+    if(numArgs == 0) {
+      for(uint8_t i = 0; i < kLogonDecoders; i++) {
+        const LogonDecoder& d = mainTrack->logonTable[i];
+        if(d.manufacturer != 0 && d.confirmed) logonResponse(d);
+      }
     }
+    else if(p[0] == 0) {
+      mainTrack->stopLogon();
+      CommManager::printf(F("<O>"));
+    }
+    else if(mainTrack->startLogon(p[0], logonResponse) == ERR_OK)
+      CommManager::printf(F("<O>"));
+    else
+      CommManager::printf(F("<X>"));
+    break;
+
+/***** SHOW RAILCOM LINK QUALITY AND TRANSMITTER DIAGNOSTICS  ****/
+
+  case 'D':       // <D [CAB]>
+    if(numArgs > 0) {
+      const RailcomLinkStats* stats = mainTrack->railcom.getLinkStats(p[0]);
+      if(stats == nullptr) CommManager::printf(F("<X>"));
+      else linkStatsResponse(*stats);
+    }
+    else {
+      linkStatsResponse(mainTrack->railcom.getDistrictStats());
+      // Emergency stop latency in microseconds, then the capture ring and 
+      // repeat cancelling counters
+      CommManager::printf(F("<D E %d %d %d %d %d>"), 
+        (int)mainTrack->getEmergencyStopLatency(), 
+        mainTrack->railcom.getCaptureCount(), 
+        mainTrack->railcom.getCaptureOverflows(),
+        mainTrack->getAckCancels(), (int)mainTrack->getRepeatsSaved());
+      // Programming track reads, failures, known value hits and misses, then
+      // the average and last read time in milliseconds
+      const serviceReadStats& reads = progTrack->getReadStats();
+      CommManager::printf(F("<D P %d %d %d %d %d %d>"), reads.reads, 
+        reads.failures, reads.fastHits, reads.fastMisses, 
+        reads.reads ? (int)(reads.totalMillis / reads.reads) : 0, 
+        reads.lastMillis);
+      // Programming track ACK pulses accepted and rejected, the width and 
+      // latency of the last one in microseconds, then the base current, 
+      // noise and threshold of the last calibration in milliamps
+      const serviceAckStats& acks = progTrack->getAckStats();
+      CommManager::printf(F("<D A %d %d %d %d %d %d %d>"), acks.accepted, 
+        acks.rejected, acks.lastWidth, acks.lastLatency, acks.baseMilliamps,
+        acks.noiseMilliamps, acks.thresholdMilliamps);
+      // Programming track CV cache hits, misses and decoder changes
+      const CVCacheStats& cache = progTrack->cvCache.getStats();
+      CommManager::printf(F("<D C %d %d %d>"), cache.hits, cache.misses, 
+        cache.flushes);
+    }
+    break;
+
 /***** TURN ON POWER FROM MOTOR SHIELD TO TRACKS  ****/
 
   case '1':      // <1>
@@ -312,6 +703,8 @@ void DCCEXParser::parse(const char *com) {
 /***** READ STATUS OF DCC++ BASE STATION  ****/
 
   case 's':      // <s>
+    // A new host session, which may have a different decoder to program
+    progTrack->cvCache.expire();
     CommManager::printf(F("<p%d MAIN>"), mainTrack->hdw.getStatus());
     CommManager::printf(F("<p%d PROG>"), progTrack->hdw.getStatus());
     for(int i=1;i<=mainTrack->numDevices;i++){
@@ -368,6 +761,64 @@ void DCCEXParser::cvResponse(serviceModeResponse response) {
   }
 }
 
+// Replies end with the number of retries. A request that failed comes back 
+// as <k ID X STATUS RETRIES>, STATUS being 1 for no reply, 2 for NACK and 3 
+// for BUSY.
 void DCCEXParser::POMResponse(RailcomPOMResponse response) {
-  CommManager::printf(F("<k %d %x>"), response.transactionID, response.data);
-}
\ No newline at end of file
+  if(response.status != kPOMSuccess)
+    CommManager::printf(F("<k %d X %d %d>"), response.transactionID, 
+      response.status, response.retries);
+  else
+    CommManager::printf(F("<k %d %x %d>"), response.transactionID, 
+      (int)response.data, response.retries);
+}
+
+// Prints the four bytes of a <m> reply as two 16-bit halves, since %x only 
+// takes an int.
+void DCCEXParser::POMLongResponse(RailcomPOMResponse response) {
+  if(response.status != kPOMSuccess) {
+    POMResponse(response);
+    return;
+  }
+  CommManager::printf(F("<k %d %x %x %d>"), response.transactionID, 
+    (int)(response.data >> 16), (int)(response.data & 0xFFFF), 
+    response.retries);
+}
+
+// Prints the four bytes of an XPOM reply separately, along with the sequence 
+// number, since %x only takes an int.
+void DCCEXParser::XPOMResponse(RailcomPOMResponse response) {
+  if(response.status != kPOMSuccess) {
+    POMResponse(response);
+    return;
+  }
+  CommManager::printf(F("<k %d %d %x %x %x %x %d>"), response.transactionID, 
+    response.sequence, (int)((response.data >> 24) & 0xFF), 
+    (int)((response.data >> 16) & 0xFF), (int)((response.data >> 8) & 0xFF), 
+    (int)(response.data & 0xFF), response.retries);
+}
+
+void DCCEXParser::locationResponse(uint16_t addr, bool present) {
+  CommManager::printf(F("<L %d %d>"), addr, present);
+}
+
+void DCCEXParser::telemetryResponse(const RailcomTelemetry& telemetry) {
+  CommManager::printf(F("<V %d %d %d %d %d %d>"), telemetry.address, 
+    telemetry.speed, telemetry.qos, telemetry.fuel, telemetry.water, 
+    telemetry.temperature);
+}
+
+// The unique ID is printed as two 16-bit halves, since %x only takes an int
+void DCCEXParser::logonResponse(const LogonDecoder& decoder) {
+  CommManager::printf(F("<@ %d %d %x %x>"), decoder.address, 
+    decoder.manufacturer, (int)(decoder.uniqueID >> 16), 
+    (int)(decoder.uniqueID & 0xFFFF));
+}
+
+// A district (address 0) or loco's link quality, <D CAB CAPTURES EMPTY CH1 
+// CH2 INVALID ACK NACK BUSY>
+void DCCEXParser::linkStatsResponse(const RailcomLinkStats& stats) {
+  CommManager::printf(F("<D %d %d %d %d %d %d %d %d %d>"), stats.address, 
+    stats.captures, stats.empty, stats.channel1, stats.channel2, 
+    stats.invalid, stats.acks, stats.nacks, stats.busys);
+}
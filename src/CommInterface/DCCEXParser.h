@@ -33,8 +33,15 @@ struct DCCEXParser
   static void parse(const char *);
   static void cvResponse(serviceModeResponse response);
   static void POMResponse(RailcomPOMResponse response);
+  static void POMLongResponse(RailcomPOMResponse response);
+  static void XPOMResponse(RailcomPOMResponse response);
+  static void locationResponse(uint16_t addr, bool present);
+  static void telemetryResponse(const RailcomTelemetry& telemetry);
+  static void logonResponse(const LogonDecoder& decoder);
+  static void linkStatsResponse(const RailcomLinkStats& stats);
 private:
   static int stringParser(const char * com, int result[]);
+  static uint32_t longParameter(const char * com, uint8_t index);
   static const int MAX_PARAMS=10; 
   static int p[MAX_PARAMS];
 };
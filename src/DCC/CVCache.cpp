@@ -0,0 +1,159 @@
+/*
+ *  CVCache.cpp
+ * 
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "CVCache.h"
+
+#include "../Accessories/EEStore.h"
+
+#if !defined(ARDUINO_ARCH_SAMD)
+#include <EEPROM.h>
+#endif
+
+CVCache* CVCache::persistent = NULL;
+
+// In the order they are usually read
+const uint8_t kKeyCVs[kCVCacheKeySize] = {8, 7, 1, 29, 17, 18};
+
+uint8_t CVCache::keyIndex(uint16_t cv) {
+  uint8_t i = 0;
+  while(i < kCVCacheKeySize && kKeyCVs[i] != cv) i++;
+  return i;
+}
+
+uint8_t CVCache::requiredKeys() {
+  int config = key[keyIndex(29)];
+  if(config >= 0 && bitRead(config, 5)) return (1 << kCVCacheKeySize) - 1;
+  return ~((1 << keyIndex(17)) | (1 << keyIndex(18))) 
+    & ((1 << kCVCacheKeySize) - 1);
+}
+
+int CVCache::get(uint16_t cv) {
+  uint8_t k = keyIndex(cv);
+  if(k < kCVCacheKeySize) return key[k];
+  for(uint8_t i = 0; i < kCVCacheSize; i++) 
+    if(entries[i].cv == cv) return entries[i].value;
+  return -1;
+}
+
+void CVCache::readBack(uint16_t cv, uint8_t value) {
+  if(cv == 0) return;
+
+  uint8_t k = keyIndex(cv);
+  if(k == kCVCacheKeySize) {
+    save(cv, value);
+    return;
+  }
+
+  // Nothing to compare against isn't a match, just the start of a key
+  if(key[k] == value) matched |= 1 << k;
+  else {
+    if(key[k] >= 0) flush();
+    key[k] = value;
+  }
+}
+
+void CVCache::written(uint16_t cv, uint8_t value) {
+  if(cv == 0) return;
+
+  // A key CV only becomes known again when it's read back. CV7 is read only,
+  // and a CV8 write resets the decoder, so neither holds the written value.
+  uint8_t k = keyIndex(cv);
+  if(k < kCVCacheKeySize) {
+    invalidate(cv);
+    if(cv != 7 && cv != 8) key[k] = value;
+  }
+  else save(cv, value);
+}
+
+void CVCache::save(uint16_t cv, uint8_t value) {
+  invalidate(cv);
+  uint8_t slot = kCVCacheSize;
+  for(uint8_t i = 0; i < kCVCacheSize; i++) {
+    if(entries[i].cv == 0) {
+      slot = i;
+      break;
+    }
+  }
+  // When full, replace the oldest entry
+  if(slot == kCVCacheSize) {
+    slot = nextEntry;
+    nextEntry = (nextEntry + 1) % kCVCacheSize;
+  }
+  entries[slot].cv = cv;
+  entries[slot].value = value;
+}
+
+void CVCache::invalidate(uint16_t cv) {
+  uint8_t k = keyIndex(cv);
+  if(k < kCVCacheKeySize) {
+    key[k] = -1;
+    matched &= ~(1 << k);
+    return;
+  }
+  for(uint8_t i = 0; i < kCVCacheSize; i++) 
+    if(entries[i].cv == cv) entries[i].cv = 0;
+}
+
+void CVCache::flush() {
+  clear();
+  stats.flushes++;
+}
+
+void CVCache::clear() {
+  for(uint8_t i = 0; i < kCVCacheSize; i++) entries[i].cv = 0;
+  for(uint8_t i = 0; i < kCVCacheKeySize; i++) key[i] = -1;
+  nextEntry = 0;
+  matched = 0;
+}
+
+// The key is stored as entries for its CVs ahead of the others
+void CVCache::load() {
+  CVCacheEntry data;
+
+  for(int i=0;i<EEStore::eeStore->data.nCVCache;i++){
+    EEPROM.get(EEStore::pointer(),data);
+    if(persistent != NULL && data.cv != 0) {
+      uint8_t k = keyIndex(data.cv);
+      if(k < kCVCacheKeySize) persistent->key[k] = data.value;
+      else persistent->save(data.cv, data.value);
+    }
+    EEStore::advance(sizeof(data));
+  }
+}
+
+void CVCache::store() {
+  EEStore::eeStore->data.nCVCache=0;
+  if(persistent == NULL) return;
+
+  CVCacheEntry data;
+  for(uint8_t i = 0; i < kCVCacheKeySize + kCVCacheSize; i++) {
+    if(i < kCVCacheKeySize) {
+      if(persistent->key[i] < 0) continue;
+      data.cv = kKeyCVs[i];
+      data.value = persistent->key[i];
+    }
+    else {
+      data = persistent->entries[i - kCVCacheKeySize];
+      if(data.cv == 0) continue;
+    }
+    EEPROM.put(EEStore::pointer(),data);
+    EEStore::advance(sizeof(CVCacheEntry));
+    EEStore::eeStore->data.nCVCache++;
+  }
+}
@@ -0,0 +1,108 @@
+/*
+ *  CVCache.h
+ * 
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDSTATION_DCC_CVCACHE_H_
+#define COMMANDSTATION_DCC_CVCACHE_H_
+
+#include <Arduino.h>
+
+// Number of CVs the programming track remembers
+const uint8_t kCVCacheSize = 32;
+
+struct CVCacheEntry {
+  uint16_t cv;      // 0 if the entry is free
+  uint8_t value;
+};
+
+struct CVCacheStats {
+  uint16_t hits;        // Reads answered from the cache without the track
+  uint16_t misses;      // Reads of CVs the cache didn't have
+  uint16_t flushes;     // Times a different decoder emptied the cache
+};
+
+// Number of CVs that identify the decoder the cache belongs to
+const uint8_t kCVCacheKeySize = 6;
+
+// Milliseconds the programming track can go without a read or write before 
+// the decoder on it has to be identified again. Swapping a loco takes longer.
+const uint16_t kCVCacheIdleTimeout = 5000;
+
+// Values read from, or written to, the decoder on the programming track, 
+// keyed by the CVs that identify it: CV8 (manufacturer), CV7 (version), and
+// the address CVs 1, 29, and 17 and 18 for a long address. The key CVs are 
+// never answered from the cache, they are always verified on the track, and 
+// one that reads back different empties the cache. Other cached values are 
+// only returned without going to the track once every key CV has been read
+// back with the cached value since the cache last expired, which happens on
+// power loss, at the start of a host session, after kCVCacheIdleTimeout and
+// when a read gets no answer at all. Until then they are just likely values.
+class CVCache {
+public:
+  // Returns the cached value of a CV, or -1 if there isn't one.
+  int get(uint16_t cv);
+  // Stores a value read back from the decoder, checking it against the key.
+  void readBack(uint16_t cv, uint8_t value);
+  // Stores a value the decoder verified a write of. Never confirms the key.
+  void written(uint16_t cv, uint8_t value);
+  // Forgets a CV, for writes that may have changed it.
+  void invalidate(uint16_t cv);
+  void clear();
+
+  // The decoder may have been swapped, so it has to be identified again 
+  // before cached values are trusted.
+  void expire() { matched = 0; }
+  bool isConfirmed() { return (matched & requiredKeys()) == requiredKeys(); }
+  static bool isKey(uint16_t cv) { return keyIndex(cv) < kCVCacheKeySize; }
+
+  void countHit() { stats.hits++; }
+  void countMiss() { stats.misses++; }
+  const CVCacheStats& getStats() { return stats; }
+
+  // Keeps this cache in EEPROM with the accessories. Only one cache can be 
+  // persistent, and it has to be set before EEStore::init().
+  void config_setPersistent() { persistent = this; }
+
+  // Called by EEStore
+  static void load();
+  static void store();
+
+private:
+  // Position of a CV in key and matched, or kCVCacheKeySize if it isn't one
+  static uint8_t keyIndex(uint16_t cv);
+  // Key CVs that have to match: CV17 and CV18 only count when CV29 says 
+  // the decoder uses its long address
+  uint8_t requiredKeys();
+  // Puts a value in entries, replacing the oldest when they're full
+  void save(uint16_t cv, uint8_t value);
+  // A different decoder is on the track
+  void flush();
+
+  int16_t key[kCVCacheKeySize] = {-1, -1, -1, -1, -1, -1};  // -1 if unknown
+  CVCacheEntry entries[kCVCacheSize] = {};
+  uint8_t nextEntry = 0;      // Entry replaced when the cache is full
+
+  // Bit n is set once key[n] has been read back with the cached value since
+  // the cache last expired
+  uint8_t matched = 0;
+  CVCacheStats stats = {};
+
+  static CVCache* persistent;
+};
+
+#endif  // COMMANDSTATION_DCC_CVCACHE_H_
@@ -19,6 +19,12 @@
 
 #include "DCCMain.h"
 
+// First instruction byte of each feature expansion function group, indexed 
+// by function group. Groups 0-2 keep the whole instruction byte in the speed 
+// table instead.
+const uint8_t kFunctionGroupOpcodes[kFunctionGroups] = 
+  {0, 0, 0, 0xDE, 0xDF, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC};
+
 DCCMain::DCCMain(uint8_t numDevices, Hardware hardware, Railcom railcom) {
   this->hdw = hardware;
   this->railcom = railcom;
@@ -34,30 +40,65 @@ DCCMain::DCCMain(uint8_t numDevices, Hardware hardware, Railcom railcom) {
     speedTable[i].cab = 0;
     speedTable[i].forward = true;
     speedTable[i].speed = 0;
+    speedTable[i].targetForward = true;
+    speedTable[i].targetSpeed = 0;
+    speedTable[i].accelRate = 0;
+    speedTable[i].decelRate = 0;
+    speedTable[i].lastStep = 0;
+    speedTable[i].functionsSet = 0;
+    speedTable[i].nextFunctionGroup = 0;
+  }
+
+  for (int i = 0; i < kMaxConsists; i++)
+  {
+    consistTable[i].address = 0;
+    for (int j = 0; j < kMaxConsistMembers; j++)
+      consistTable[i].members[j] = 0;
+    consistTable[i].reversed = 0;
   }
+
+  for (int i = 0; i < kLogonDecoders; i++)
+    logonTable[i].manufacturer = 0;
 }
 
-void DCCMain::schedulePacket(const uint8_t buffer[], uint8_t byteCount, 
-  uint8_t repeats, uint16_t identifier, PacketType type, uint16_t address) {
-  
-  Packet newPacket;
+void DCCMain::buildPacket(Packet& packet, const uint8_t buffer[], 
+  uint8_t byteCount, uint8_t repeats, uint16_t identifier, PacketType type, 
+  uint16_t address) {
 
   uint8_t checksum=0;
   for (int b=0; b<byteCount; b++) {
     checksum ^= buffer[b];
-    newPacket.payload[b] = buffer[b];
+    packet.payload[b] = buffer[b];
   }
-  newPacket.payload[byteCount] = checksum;
-  newPacket.length = byteCount+1;
-  newPacket.repeats = repeats;
-  newPacket.transmitID = identifier;
-  newPacket.type = type;
-  newPacket.address = address;
+  packet.payload[byteCount] = checksum;
+  packet.length = byteCount+1;
+  packet.repeats = repeats;
+  packet.transmitID = identifier;
+  packet.type = type;
+  packet.address = address;
+}
 
-  const Packet pushPacket = newPacket;
+void DCCMain::schedulePacket(const uint8_t buffer[], uint8_t byteCount, 
+  uint8_t repeats, uint16_t identifier, PacketType type, uint16_t address) {
+  
+  Packet newPacket;
+  buildPacket(newPacket, buffer, byteCount, repeats, identifier, type, 
+    address);
+
+  queuePackets(&newPacket, 1);
+}
+
+bool DCCMain::queuePackets(const Packet packets[], uint8_t count) {
   noInterrupts();
-  packetQueue.push(pushPacket); // Push the packet into the queue for processing
-  interrupts();  
+  if(packetQueue.count() + count > kMainQueueSize) {
+    interrupts();
+    return false;
+  }
+  for (uint8_t i = 0; i < count; i++)
+    packetQueue.push(packets[i]); // Push the packet into the queue
+  interrupts();
+
+  return true;
 }
 
 void DCCMain::updateSpeed() {
@@ -65,57 +106,92 @@ void DCCMain::updateSpeed() {
 
   for (; nextDev < numDevices; nextDev++) {
     if (speedTable[nextDev].cab > 0) {
-      setThrottleResponse response;
-      setThrottle(nextDev, speedTable[nextDev].cab, speedTable[nextDev].speed, 
-        speedTable[nextDev].forward, response);
+      sendThrottle(speedTable[nextDev].cab, speedTable[nextDev].speed, 
+        speedTable[nextDev].forward);
+      refreshFunctions(nextDev);
       nextDev++;
       return;
     }
   }
   for (nextDev = 0; nextDev < numDevices; nextDev++) {
     if (speedTable[nextDev].cab > 0) {
-      setThrottleResponse response;
-      setThrottle(nextDev, speedTable[nextDev].cab, speedTable[nextDev].speed, 
-        speedTable[nextDev].forward, response);
+      sendThrottle(speedTable[nextDev].cab, speedTable[nextDev].speed, 
+        speedTable[nextDev].forward);
+      refreshFunctions(nextDev);
       nextDev++;
       return;
     }
   }
 }
 
-uint8_t DCCMain::setThrottle(uint8_t slot, uint16_t addr, uint8_t speed, 
-  uint8_t direction, setThrottleResponse& response) {
-  
-  uint8_t b[5];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
-  uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
+void DCCMain::updateMomentum() {
+  uint32_t now = millis();
 
-  if((slot < 1) || (slot > numDevices))
-    return ERR_OUT_OF_RANGE;
+  for (uint8_t i = 1; i <= numDevices; i++) {
+    Speed& s = speedTable[i];
+
+    if(s.cab == 0) continue;
+    if(s.speed == s.targetSpeed && s.forward == s.targetForward) continue;
+    // Each step queues a packet, so leave the rest for a later pass if the 
+    // queue is full rather than dropping the step.
+    if(packetQueue.count() >= kMainQueueSize) return;
+
+    // A change of direction has to slow down to a stop first
+    bool reversing = (s.forward != s.targetForward);
+    bool slowing = reversing || (s.targetSpeed < s.speed);
+    uint16_t rate = slowing ? s.decelRate : s.accelRate;
 
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
-  } 
+    if(rate == 0) {
+      s.speed = s.targetSpeed;
+      s.forward = s.targetForward;
+    }
+    else {
+      uint32_t steps = (now - s.lastStep) / rate;
+      if(steps == 0) continue;
+      // Keep the time base even if loop() was late, rather than restarting 
+      // the interval from now.
+      s.lastStep += steps * rate;
+
+      if(reversing) {
+        if(steps >= s.speed) {
+          // Stopped; any steps left over start off in the new direction
+          steps -= s.speed;
+          s.forward = s.targetForward;
+          s.speed = (steps > s.targetSpeed) ? s.targetSpeed : steps;
+        }
+        else s.speed -= steps;
+      }
+      else if(slowing) {
+        if(steps > (uint8_t)(s.speed - s.targetSpeed)) s.speed = s.targetSpeed;
+        else s.speed -= steps;
+      }
+      else {
+        if(steps > (uint8_t)(s.targetSpeed - s.speed)) s.speed = s.targetSpeed;
+        else s.speed += steps;
+      }
+    }
 
-  b[nB++]=lowByte(addr);
-  railcomAddr |= lowByte(addr);
-  b[nB++]=0x3F;   // 128-step speed control byte
-  if(speed>=0)
-    // max speed is 126, but speed codes range from 2-127 
-    // (0=stop, 1=emergency stop)
-    b[nB++]=speed+(speed>0)+direction*128;   
-  else{
-    b[nB++]=1;
-    speed=0;
+    sendThrottle(s.cab, s.speed, s.forward);
   }
+}
 
-  incrementCounterID();
-  schedulePacket(b, nB, 0, counterID, kThrottleType, railcomAddr);
+void DCCMain::sendThrottle(uint16_t addr, uint8_t speed, uint8_t direction) {
+  SpeedInstruction instruction;
+  instruction.speed = speed;
+  instruction.direction = direction;
+
+  scheduleInstruction(addr, instruction);
+}
+
+uint8_t DCCMain::setThrottle(uint8_t slot, uint16_t addr, uint8_t speed, 
+  uint8_t direction, setThrottleResponse& response) {
 
-  speedTable[slot].speed = speed;
-  speedTable[slot].cab = addr;
-  speedTable[slot].forward = direction; 
+  if((slot < 1) || (slot > numDevices))
+    return ERR_OUT_OF_RANGE;
+
+  uint16_t sendAddr = updateThrottle(slot, addr, speed, direction);
+  if(sendAddr != 0)
+    sendThrottle(sendAddr, speed, direction);
 
   response.device = addr;
   response.direction = direction;
@@ -125,64 +201,227 @@ uint8_t DCCMain::setThrottle(uint8_t slot, uint16_t addr, uint8_t speed,
   return ERR_OK;
 }
 
-uint8_t DCCMain::setFunction(uint16_t addr, uint8_t byte1, 
-  genericResponse& response) {
-  
-  uint8_t b[4];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
-  uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
+uint16_t DCCMain::updateThrottle(uint8_t slot, uint16_t addr, uint8_t speed, 
+  uint8_t direction) {
 
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
+  // Locos in a consist are driven through the consist address, and only one 
+  // slot refreshes each consist.
+  addr = getConsistAddress(addr);
+  for (uint8_t i = 1; i <= numDevices; i++) {
+    if(i != slot && speedTable[i].cab == addr)
+      speedTable[i].cab = 0;
   }
 
-  b[nB++] = lowByte(addr);
-  railcomAddr |= lowByte(addr);
+  claimSlot(slot, addr, direction);
+  Speed& s = speedTable[slot];
 
-  b[nB++] = (byte1 | 0x80) & 0xBF;
+  bool ramping = (s.speed != s.targetSpeed) || (s.forward != s.targetForward);
+  s.targetSpeed = speed;
+  s.targetForward = direction;
 
-  incrementCounterID();
-  // Repeat the packet four times (one plus 3 repeats)
-  schedulePacket(b, nB, 3, counterID, kFunctionType, railcomAddr);  
+  bool slowing = (s.forward != direction) || (speed < s.speed);
+  if((slowing ? s.decelRate : s.accelRate) == 0) {
+    s.speed = speed;
+    s.forward = direction;
+    return addr;
+  }
+  
+  if(!ramping) {
+    // updateMomentum() sends the first step one interval from now
+    s.lastStep = millis();
+  }
+  return 0;
+}
+
+void DCCMain::claimSlot(uint8_t slot, uint16_t addr, uint8_t direction) {
+  Speed& s = speedTable[slot];
+  if(s.cab == addr) return;
+
+  s.cab = addr;
+  s.speed = 0;
+  s.forward = direction;
+  s.targetSpeed = 0;
+  s.targetForward = direction;
+  s.functionsSet = 0;
+}
+
+uint8_t DCCMain::emergencyStop(uint16_t addr, genericResponse& response) {
+  EmergencyStopInstruction instruction;
+
+  // Locos in a consist only take speed commands on the consist address
+  if(addr != 0) addr = getConsistAddress(addr);
+  // The interrupt only ever takes stops off the queue, so if it's full now 
+  // there's no room for this one. Stopping everything still stops this loco
+  // and the ones waiting.
+  if(eStopQueue.count() >= kEStopQueueSize) addr = 0;
+
+  Packet packet;
+  buildInstruction(packet, addr, instruction);
+  uint16_t railcomAddr = packet.address;
+
+  // Stop refresh and momentum from starting the loco(s) again
+  for (uint8_t i = 1; i <= numDevices; i++) {
+    if(addr != 0 && speedTable[i].cab != addr) continue;
+    speedTable[i].speed = 0;
+    speedTable[i].targetSpeed = 0;
+  }
+
+  noInterrupts();
+  if(addr == 0) {
+    packetQueue.clear();
+    eStopQueue.clear();   // This stop covers them
+  }
+  else {
+    packetQueue.removeIf([railcomAddr](const Packet& p) {
+      return p.type == kThrottleType && p.address == railcomAddr;
+    });
+  }
+  eStopQueue.push(packet);
+  eStopRequested = micros();
+  interrupts();
 
   response.transactionID = counterID;
 
   return ERR_OK;
 }
 
+uint8_t DCCMain::setMomentum(uint8_t slot, uint16_t accelRate, 
+  uint16_t decelRate) {
+
+  if((slot < 1) || (slot > numDevices))
+    return ERR_OUT_OF_RANGE;
+
+  speedTable[slot].accelRate = accelRate;
+  speedTable[slot].decelRate = decelRate;
+
+  return ERR_OK;
+}
+
+uint8_t DCCMain::setFunction(uint16_t addr, uint8_t byte1, 
+  genericResponse& response) {
+  
+  Packet packet;
+  buildFunction(packet, addr, byte1);
+  queuePackets(&packet, 1);
+
+  response.transactionID = packet.transmitID;
+
+  return ERR_OK;
+}
+
 uint8_t DCCMain::setFunction(uint16_t addr, uint8_t byte1, uint8_t byte2, 
   genericResponse& response) {
   
-  uint8_t b[4];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
-  uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
+  Packet packet;
+  buildFunction(packet, addr, byte1, byte2);
+  queuePackets(&packet, 1);
 
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
-  }
+  response.transactionID = packet.transmitID;
+
+  return ERR_OK;
+}
 
-  b[nB++] = lowByte(addr);
-  railcomAddr |= lowByte(addr);
+void DCCMain::buildFunction(Packet& packet, uint16_t addr, uint8_t byte1) {
+  FunctionGroupInstruction instruction;
+  instruction.byte1 = byte1;
+
+  buildInstruction(packet, addr, instruction);
+
+  uint8_t b[FunctionGroupInstruction::length];
+  instruction.encode(b);
+  // 100DDDDD is F0-F4, 1011DDDD is F5-F8 and 1010DDDD is F9-F12
+  if((b[0] & 0xE0) == 0x80) storeFunctionGroup(addr, 0, b[0]);
+  else if((b[0] & 0xF0) == 0xB0) storeFunctionGroup(addr, 1, b[0]);
+  else storeFunctionGroup(addr, 2, b[0]);
+}
 
-  // for safety this guarantees that first byte will either be 0xDE 
-  // (for F13-F20) or 0xDF (for F21-F28)
-  b[nB++]=(byte1 | 0xDE) & 0xDF;     
-  b[nB++]=byte2;
+void DCCMain::buildFunction(Packet& packet, uint16_t addr, uint8_t byte1, 
+  uint8_t byte2) {
   
-  incrementCounterID();
-  // Repeat the packet four times (one plus 3 repeats)
-  schedulePacket(b, nB, 3, counterID, kFunctionType, railcomAddr);  
+  FunctionExpansionInstruction instruction;
+  instruction.byte1 = byte1;
+  instruction.byte2 = byte2;
 
-  response.transactionID = counterID;
+  buildInstruction(packet, addr, instruction);
+
+  uint8_t b[FunctionExpansionInstruction::length];
+  instruction.encode(b);
+  for (uint8_t group = 3; group < kFunctionGroups; group++) {
+    if(kFunctionGroupOpcodes[group] == b[0])
+      storeFunctionGroup(addr, group, b[1]);
+  }
+}
+
+uint8_t DCCMain::setBinaryState(uint16_t addr, uint16_t state, bool value, 
+  genericResponse& response) {
+  
+  if(state > 32767) return ERR_OUT_OF_RANGE;
+
+  if(state < 128) {
+    BinaryStateShortInstruction instruction;
+    instruction.state = state;
+    instruction.value = value;
+    response.transactionID = scheduleInstruction(addr, instruction);
+  }
+  else {
+    BinaryStateLongInstruction instruction;
+    instruction.state = state;
+    instruction.value = value;
+    response.transactionID = scheduleInstruction(addr, instruction);
+  }
 
   return ERR_OK;
 }
 
+void DCCMain::storeFunctionGroup(uint16_t addr, uint8_t group, 
+  uint8_t value) {
+  
+  for (uint8_t i = 1; i <= numDevices; i++) {
+    if(speedTable[i].cab != addr) continue;
+    speedTable[i].functions[group] = value;
+    bitSet(speedTable[i].functionsSet, group);
+  }
+}
+
+void DCCMain::refreshFunctions(uint8_t slot) {
+  Speed& s = speedTable[slot];
+  if(s.functionsSet == 0) return;
+
+  // Find the next group that has been set, wrapping around to group 0
+  uint8_t group = s.nextFunctionGroup;
+  while(!bitRead(s.functionsSet, group)) 
+    group = (group + 1) % kFunctionGroups;
+  s.nextFunctionGroup = (group + 1) % kFunctionGroups;
+
+  // Refresh packets only go out once, the original went out with repeats
+  if(group < 3) {
+    FunctionGroupInstruction instruction;
+    instruction.byte1 = s.functions[group];
+    scheduleInstruction(s.cab, instruction, 0);
+  }
+  else {
+    FunctionExpansionInstruction instruction;
+    instruction.byte1 = kFunctionGroupOpcodes[group];
+    instruction.byte2 = s.functions[group];
+    scheduleInstruction(s.cab, instruction, 0);
+  }
+}
+
 uint8_t DCCMain::setAccessory(uint16_t addr, uint8_t number, bool activate, 
   genericResponse& response) {
   
+  Packet packet;
+  buildAccessory(packet, addr, number, activate);
+  queuePackets(&packet, 1);
+
+  response.transactionID = packet.transmitID;
+
+  return ERR_OK;
+}
+
+void DCCMain::buildAccessory(Packet& packet, uint16_t addr, uint8_t number, 
+  bool activate) {
+  
   uint8_t b[3];     // Packet payload. Save space for checksum byte
   uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
 
@@ -196,145 +435,400 @@ uint8_t DCCMain::setAccessory(uint16_t addr, uint8_t number, bool activate,
 
   incrementCounterID();
   // Repeat the packet four times (one plus 3 repeats)
-  schedulePacket(b, 2, 3, counterID, kAccessoryType, railcomAddr); 
+  buildPacket(packet, b, 2, 3, counterID, kAccessoryType, railcomAddr); 
+}
+
+uint8_t DCCMain::submitBatch(const batchOperation ops[], uint8_t count, 
+  genericResponse& response) {
+  
+  // Each operation makes at most one packet. Only loop() adds to the queue 
+  // and the ISR only takes from it, so there's at least this much room when 
+  // the packets are published below.
+  if(count > kMainQueueSize - packetQueue.count()) return ERR_BUSY;
+
+  for (uint8_t i = 0; i < count; i++) {
+    if(ops[i].type == kThrottleType 
+      && (ops[i].slot < 1 || ops[i].slot > numDevices))
+      return ERR_OUT_OF_RANGE;
+    if(ops[i].type != kThrottleType && ops[i].type != kFunctionType 
+      && ops[i].type != kAccessoryType)
+      return ERR_OUT_OF_RANGE;
+  }
+
+  // Encode everything with interrupts on
+  Packet packets[kMainQueueSize];
+  uint8_t nPackets = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    const batchOperation& op = ops[i];
+
+    switch(op.type) {
+    case kThrottleType: {
+      uint16_t sendAddr = updateThrottle(op.slot, op.addr, op.value1, 
+        op.value2);
+      if(sendAddr == 0) break;  // Momentum will send the speed
+      SpeedInstruction instruction;
+      instruction.speed = op.value1;
+      instruction.direction = op.value2;
+      buildInstruction(packets[nPackets++], sendAddr, instruction);
+      break;
+      }
+    case kFunctionType:
+      if(op.byteCount == 1) 
+        buildFunction(packets[nPackets++], op.addr, op.value1);
+      else
+        buildFunction(packets[nPackets++], op.addr, op.value1, op.value2);
+      break;
+    case kAccessoryType:
+      buildAccessory(packets[nPackets++], op.addr, op.value1, op.value2);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // ...then publish them together
+  queuePackets(packets, nPackets);
 
   response.transactionID = counterID;
 
   return ERR_OK;
 }
 
-uint8_t DCCMain::writeCVByteMain(uint16_t addr, uint16_t cv, uint8_t bValue, 
-  genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
+uint8_t DCCMain::setExtendedAccessory(uint16_t addr, uint8_t aspect, 
+  genericResponse& response) {
   
-  uint8_t b[6];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
+  uint8_t b[4];     // Packet payload. Save space for checksum byte
   uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
 
-  cv--;   // actual CV addresses are cv-1 (0-1023)
-
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
-  } 
+  if(addr > 2047) return ERR_OUT_OF_RANGE;
 
-  b[nB++] = lowByte(addr);
-  railcomAddr |= lowByte(addr);
-
-  // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  b[nB++] = 0xEC + (highByte(cv) & 0x03);   
-  b[nB++] = lowByte(cv);
-  b[nB++] = bValue;
-
-  railcom.config_setPOMResponseCallback(POMCallback);
+  // first byte is of the form 10AAAAAA, where AAAAAA are address bits 7-2
+  b[0] = ((addr >> 2) & 0x3F) + 128;
+  // second byte is of the form 0AAA0AA1, where the first AAA are the ones 
+  // complement of address bits 10-8 and the second AA are address bits 1-0
+  b[1] = ((((addr >> 8) & 0x07) ^ 0x07) << 4) + ((addr & 0x03) << 1) + 1;
+  // third byte is the aspect
+  b[2] = aspect;
+  railcomAddr = (b[0] << 8) | b[1];
 
   incrementCounterID();
   // Repeat the packet four times (one plus 3 repeats)
-  schedulePacket(b, nB, 3, counterID, kPOMByteWriteType, railcomAddr); 
+  schedulePacket(b, 3, 3, counterID, kExtAccessoryType, railcomAddr); 
 
   response.transactionID = counterID;
 
   return ERR_OK;
 }
 
+uint8_t DCCMain::writeCVByteMain(uint16_t addr, uint16_t cv, uint8_t bValue, 
+  genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
+  
+  POMWriteByteInstruction instruction;
+  instruction.cv = cv - 1;   // actual CV addresses are cv-1 (0-1023)
+  instruction.value = bValue;
+
+  return schedulePOM(addr, instruction, 0, response, POMCallback);
+}
+
 uint8_t DCCMain::writeCVBitMain(uint16_t addr, uint16_t cv, uint8_t bNum, 
   uint8_t bValue, genericResponse& response,
   void (*POMCallback)(RailcomPOMResponse)) {
   
-  uint8_t b[6];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
-  uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
-
-  cv--;   // actual CV addresses are cv-1 (0-1023)
-
   bValue = bValue % 2;
   bNum = bNum % 8;
 
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
-  } 
+  POMWriteBitInstruction instruction;
+  instruction.cv = cv - 1;   // actual CV addresses are cv-1 (0-1023)
+  instruction.value = 0xF0 + (bValue * 8) + bNum;
 
-  b[nB++] = lowByte(addr);
-  railcomAddr |= lowByte(addr);
+  return schedulePOM(addr, instruction, 0, response, POMCallback);
+}
 
-  // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  b[nB++] = 0xE8 + (highByte(cv) & 0x03);   
-  b[nB++] = lowByte(cv);
-  b[nB++] = 0xF0 + (bValue * 8) + bNum;
+uint8_t DCCMain::readCVByteMain(uint16_t addr, uint16_t cv, 
+  genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
 
-  railcom.config_setPOMResponseCallback(POMCallback);
+  POMReadByteInstruction instruction;
+  instruction.cv = cv - 1;   // actual CV addresses are cv-1 (0-1023)
+  instruction.value = 0;
 
-  incrementCounterID();
-  schedulePacket(b, nB, 4, counterID, kPOMBitWriteType, railcomAddr);
+  return schedulePOM(addr, instruction, 0, response, POMCallback);
+}
 
-  response.transactionID = counterID;
+uint8_t DCCMain::readCVBytesMain(uint16_t addr, uint16_t cv, 
+  genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
 
-  return ERR_OK;
+  POMReadBytesInstruction instruction;
+  instruction.cv = cv - 1;   // actual CV addresses are cv-1 (0-1023)
+
+  return schedulePOM(addr, instruction, 0, response, POMCallback);
 }
 
-uint8_t DCCMain::readCVByteMain(uint16_t addr, uint16_t cv, 
+void DCCMain::resendPOM() {
+  int8_t i = railcom.nextPOMResend();
+  if(i < 0) return;
+
+  // Try again next time round if the queue is full
+  if(queuePackets(&POMPackets[i], 1)) railcom.POMResent(i);
+}
+
+uint8_t DCCMain::writeCVBytesXPOM(uint16_t addr, uint32_t cv, 
+  const uint8_t values[], uint8_t count, genericResponse& response, 
+  void (*POMCallback)(RailcomPOMResponse)) {
+
+  if(cv < 1 || cv > 0x1000000UL || count < 1 || count > 4) 
+    return ERR_OUT_OF_RANGE;
+
+  cv = cv - 1;   // actual CV addresses are cv-1
+  switch(count) {
+  case 1: 
+    return scheduleXPOMWrite<1>(addr, cv, values, response, POMCallback);
+  case 2: 
+    return scheduleXPOMWrite<2>(addr, cv, values, response, POMCallback);
+  case 3: 
+    return scheduleXPOMWrite<3>(addr, cv, values, response, POMCallback);
+  default: 
+    return scheduleXPOMWrite<4>(addr, cv, values, response, POMCallback);
+  }
+}
+
+uint8_t DCCMain::readCVBytesXPOM(uint16_t addr, uint32_t cv, 
   genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
 
-  uint8_t b[6];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
-  uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
+  if(cv < 1 || cv > 0x1000000UL) return ERR_OUT_OF_RANGE;
 
-  cv--;   // actual CV addresses are cv-1 (0-1023)
+  XPOMReadInstruction instruction;
+  instruction.cv = cv - 1;   // actual CV addresses are cv-1
+  instruction.sequence = nextXPOMSequence();
 
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
-  } 
+  return schedulePOM(addr, instruction, instruction.sequence, response, 
+    POMCallback);
+}
 
-  b[nB++] = lowByte(addr);
-  railcomAddr |= lowByte(addr);
+uint8_t DCCMain::startLogon(uint16_t firstAddress, 
+  void (*logonCallback)(const LogonDecoder&)) {
+  
+  if(firstAddress < 128 || firstAddress > 10239) return ERR_OUT_OF_RANGE;
+  if(!railcom.enable) return ERR_BUSY;
+
+  this->logonCallback = logonCallback;
+  nextLogonAddress = firstAddress;
+  // A new session number makes decoders that logged on before answer again
+  logonSession++;
+  lastLogonEnable = millis() - kLogonInterval;
+  logonRunning = true;
+
+  return ERR_OK;
+}
 
-  // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  b[nB++] = 0xE4 + (highByte(cv) & 0x03);   
-  b[nB++] = lowByte(cv);
-  b[nB++] = 0;  // For some reason the railcom spec leaves an empty byte  
+uint16_t DCCMain::findFreeAddress() {
+  for(; nextLogonAddress <= 10239; nextLogonAddress++) {
+    bool used = false;
+    for (uint8_t i = 1; i <= numDevices && !used; i++) 
+      used = speedTable[i].cab == nextLogonAddress;
+    for (uint8_t i = 0; i < kLogonDecoders && !used; i++) 
+      used = logonTable[i].manufacturer != 0 && 
+        logonTable[i].address == nextLogonAddress;
+    if(!used) return nextLogonAddress++;
+  }
+  return 0;
+}
 
-  railcom.config_setPOMResponseCallback(POMCallback);
+void DCCMain::sendLogonAssign(LogonDecoder& decoder) {
+  uint8_t b[kPacketMaxSize];
+  uint8_t nB = PacketEncoder::encodeLogonAssign(decoder.manufacturer, 
+    decoder.uniqueID, decoder.address, b);
 
   incrementCounterID();
-  // Repeat the packet four times (one plus 3 repeats)
-  schedulePacket(b, nB, 3, counterID, kPOMReadType, railcomAddr); 
+  Packet packet;
+  buildPacket(packet, b, nB, 0, counterID, kLogonAssignType, 
+    (kLogonAddress << 8) | b[1]);
+  if(!queuePackets(&packet, 1)) return;   // Try again after the timeout
+
+  decoder.assignID = counterID;
+  decoder.lastAssign = millis();
+  decoder.attempts++;
+}
 
-  response.transactionID = counterID;
+void DCCMain::updateLogon() {
+  if(!logonRunning) return;
+
+  // Assign an address to a decoder that answered LOGON_ENABLE
+  uint16_t manufacturer;
+  uint32_t uniqueID;
+  if(railcom.takeLogonReply(manufacturer, uniqueID)) {
+    LogonDecoder* decoder = nullptr;
+    LogonDecoder* free = nullptr;
+    for (uint8_t i = 0; i < kLogonDecoders; i++) {
+      LogonDecoder& d = logonTable[i];
+      if(d.manufacturer == manufacturer && d.uniqueID == uniqueID) 
+        decoder = &d;
+      else if(d.manufacturer == 0 && free == nullptr) free = &d;
+    }
+    if(decoder == nullptr && free != nullptr) {
+      uint16_t addr = findFreeAddress();
+      if(addr != 0) {
+        decoder = free;
+        decoder->manufacturer = manufacturer;
+        decoder->uniqueID = uniqueID;
+        decoder->address = addr;
+      }
+    }
+    // A decoder that logs on again gets the address it had before
+    if(decoder != nullptr) {
+      decoder->attempts = 0;
+      decoder->confirmed = false;
+      sendLogonAssign(*decoder);
+    }
+  }
 
-  return ERR_OK;
+  // Put confirmed decoders in the speed table
+  uint16_t assigned = railcom.takeLogonAssigned();
+  for (uint8_t i = 0; i < kLogonDecoders; i++) {
+    LogonDecoder& d = logonTable[i];
+    if(d.manufacturer == 0) continue;
+
+    if(!d.confirmed && assigned != 0 && d.assignID == assigned) {
+      d.confirmed = true;
+      for (uint8_t j = 1; j <= numDevices; j++) {
+        if(speedTable[j].cab == 0 || speedTable[j].cab == d.address) {
+          // Whatever was last in the slot mustn't carry over
+          claimSlot(j, d.address, 1);
+          break;
+        }
+      }
+      if(logonCallback != nullptr) logonCallback(d);
+    }
+    else if(!d.confirmed && millis() - d.lastAssign > kLogonAssignTimeout) {
+      if(d.attempts < kLogonAssignAttempts) sendLogonAssign(d);
+      else d.manufacturer = 0;   // Free the entry, it can log on again
+    }
+  }
 
+  if(millis() - lastLogonEnable >= kLogonInterval) {
+    lastLogonEnable = millis();
+
+    uint8_t b[kPacketMaxSize];
+    uint8_t nB = PacketEncoder::encodeLogonEnable(kLogonLocos, kLogonCID, 
+      logonSession, b);
+    incrementCounterID();
+    schedulePacket(b, nB, 0, counterID, kLogonEnableType, 
+      (kLogonAddress << 8) | b[1]);
+  }
 }
 
-uint8_t DCCMain::readCVBytesMain(uint16_t addr, uint16_t cv, 
-  genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
+uint8_t DCCMain::addToConsist(uint8_t consistAddr, uint16_t addr, 
+  bool reversed, genericResponse& response) {
 
-  uint8_t b[5];     // Packet payload. Save space for checksum byte
-  uint8_t nB = 0;   // Counter for number of bytes in the packet
-  uint16_t railcomAddr = 0;  // For detecting the railcom instruction type
+  if(consistAddr < 1 || consistAddr > 127 || addr == 0) 
+    return ERR_OUT_OF_RANGE;
+  // Leave room for clearing CV19 in an old consist as well as setting it
+  if(packetQueue.count() > kMainQueueSize - 2) return ERR_BUSY;
+
+  // A loco can only be in one consist at a time
+  if(getConsistAddress(addr) != addr && getConsistAddress(addr) != consistAddr)
+    removeFromConsist(addr, response);
+
+  Consist* consist = nullptr;
+  Consist* freeConsist = nullptr;
+  for (uint8_t i = 0; i < kMaxConsists; i++) {
+    if(consistTable[i].address == consistAddr) consist = &consistTable[i];
+    else if(consistTable[i].address == 0 && freeConsist == nullptr) 
+      freeConsist = &consistTable[i];
+  }
+  if(consist == nullptr) {
+    if(freeConsist == nullptr) return ERR_OUT_OF_RANGE;
+    consist = freeConsist;
+    consist->address = consistAddr;
+    consist->reversed = 0;
+  }
 
-  cv--;   // actual CV addresses are cv-1 (0-1023)
+  int8_t member = -1;
+  for (uint8_t i = 0; i < kMaxConsistMembers; i++) {
+    if(consist->members[i] == addr) {
+      member = i;
+      break;
+    }
+    if(consist->members[i] == 0 && member < 0) member = i;
+  }
+  if(member < 0) return ERR_OUT_OF_RANGE;
 
-  if(addr > 127) {
-    b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
-    railcomAddr = (highByte(addr) | 0xC0) << 8;
-  } 
+  consist->members[member] = addr;
+  bitWrite(consist->reversed, member, reversed);
 
-  b[nB++] = lowByte(addr);
-  railcomAddr |= lowByte(addr);
+  // The loco no longer needs a refresh slot of its own
+  for (uint8_t i = 1; i <= numDevices; i++) {
+    if(speedTable[i].cab == addr)
+      speedTable[i].cab = 0;
+  }
 
-  // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  b[nB++] = 0xE0 + (highByte(cv) & 0x03);   
-  b[nB++] = lowByte(cv);  
+  // Bit 7 of CV19 reverses the loco's direction relative to the consist
+  return writeCVByteMain(addr, 19, consistAddr | (reversed ? 0x80 : 0), 
+    response, nullptr);
+}
 
-  railcom.config_setPOMResponseCallback(POMCallback);
+uint8_t DCCMain::removeFromConsist(uint16_t addr, genericResponse& response) {
+  if(packetQueue.count() >= kMainQueueSize) return ERR_BUSY;
+
+  for (uint8_t i = 0; i < kMaxConsists; i++) {
+    if(consistTable[i].address == 0) continue;
+
+    bool empty = true;
+    bool found = false;
+    for (uint8_t j = 0; j < kMaxConsistMembers; j++) {
+      if(consistTable[i].members[j] == addr) {
+        consistTable[i].members[j] = 0;
+        bitClear(consistTable[i].reversed, j);
+        found = true;
+      }
+      else if(consistTable[i].members[j] != 0) empty = false;
+    }
+    if(!found) continue;
+
+    if(empty) {
+      // Nothing left to drive, so stop refreshing the consist address
+      for (uint8_t k = 1; k <= numDevices; k++) {
+        if(speedTable[k].cab == consistTable[i].address)
+          speedTable[k].cab = 0;
+      }
+      consistTable[i].address = 0;
+    }
 
-  incrementCounterID();
-  // Repeat the packet four times (one plus 3 repeats)
-  schedulePacket(b, nB, 3, counterID, kPOMLongReadType, railcomAddr); 
+    return writeCVByteMain(addr, 19, 0, response, nullptr);
+  }
 
-  response.transactionID = counterID;
+  return ERR_OUT_OF_RANGE;
+}
 
-  return ERR_OK;
+uint8_t DCCMain::removeConsist(uint8_t consistAddr, 
+  genericResponse& response) {
+
+  for (uint8_t i = 0; i < kMaxConsists; i++) {
+    if(consistTable[i].address != consistAddr || consistAddr == 0) continue;
+
+    uint8_t members = 0;
+    for (uint8_t j = 0; j < kMaxConsistMembers; j++) {
+      if(consistTable[i].members[j] != 0) members++;
+    }
+    if(packetQueue.count() + members > kMainQueueSize) return ERR_BUSY;
+
+    for (uint8_t j = 0; j < kMaxConsistMembers; j++) {
+      if(consistTable[i].members[j] != 0)
+        removeFromConsist(consistTable[i].members[j], response);
+    }
+    return ERR_OK;
+  }
+
+  return ERR_OUT_OF_RANGE;
+}
+
+uint16_t DCCMain::getConsistAddress(uint16_t addr) {
+  for (uint8_t i = 0; i < kMaxConsists; i++) {
+    if(consistTable[i].address == 0) continue;
+    for (uint8_t j = 0; j < kMaxConsistMembers; j++) {
+      if(consistTable[i].members[j] == addr) 
+        return consistTable[i].address;
+    }
+  }
 
+  return addr;
 }
\ No newline at end of file
@@ -22,9 +22,57 @@
 
 #include <Arduino.h>
 
-#include "Waveform.h"
-#include "Railcom.h"
+#include "PacketEncoder.h"
 #include "Queue.h"
+#include "Railcom.h"
+#include "Waveform.h"
+
+// Number of packets that can be waiting to go out on the main track. This is
+// also the largest batch submitBatch() can take, and has to be at least 
+// kMaxConsistMembers so a whole consist can be broken up at once. Each packet
+// is 11 bytes, and the queue, submitBatch() and the <*> parser each hold this
+// many, so keep it small on the AVR.
+const uint8_t kMainQueueSize = 6;
+
+// Emergency stops for single locos that can wait for the next packet 
+// boundary. One more turns into a stop for every loco.
+const uint8_t kEStopQueueSize = 2;
+
+// Function groups remembered per slot: F0-F4, F5-F8, F9-F12, then F13-F20 
+// up to F61-F68 in eights
+const uint8_t kFunctionGroups = 10;
+
+// Repeats for POM packets when railcom is tracking the reply. Decoders only 
+// change a CV after two identical packets, so writes keep one repeat.
+const uint8_t kPOMTrackedWriteRepeats = 1;
+const uint8_t kPOMTrackedReadRepeats = 0;
+
+// Size of the advanced consist table
+const uint8_t kMaxConsists = 8;
+const uint8_t kMaxConsistMembers = 6;
+
+// Decoders the automatic logon engine can keep track of
+const uint8_t kLogonDecoders = 8;
+// Milliseconds between LOGON_ENABLE broadcasts while logon is running
+const uint16_t kLogonInterval = 250;
+// Milliseconds to wait for a decoder to answer LOGON_ASSIGN, and the number 
+// of times it is sent before giving up
+const uint16_t kLogonAssignTimeout = 500;
+const uint8_t kLogonAssignAttempts = 3;
+// Command station ID sent in LOGON_ENABLE. Decoders remember it along with the
+// session number so they don't log on again in the same session.
+const uint16_t kLogonCID = 0x4443;
+
+// A decoder found by automatic logon
+struct LogonDecoder {
+  uint16_t manufacturer;    // Zero if the entry is free
+  uint32_t uniqueID;
+  uint16_t address;         // Long address given to the decoder
+  uint16_t assignID;        // Transmit ID of the last LOGON_ASSIGN
+  uint32_t lastAssign;      // millis() when LOGON_ASSIGN was last queued
+  uint8_t attempts;
+  bool confirmed;           // The decoder answered LOGON_ASSIGN
+};
 
 struct setThrottleResponse {
   uint8_t device;
@@ -37,6 +85,16 @@ struct genericResponse {
   uint16_t transactionID;
 };
 
+// One operation in a batch passed to DCCMain::submitBatch()
+struct batchOperation {
+  PacketType type;    // kThrottleType, kFunctionType or kAccessoryType
+  uint16_t addr;
+  uint8_t slot;       // Speed table slot, throttle operations only
+  uint8_t byteCount;  // Function operations: 1 for F0-F12, 2 for F13-F68
+  uint8_t value1;     // Speed, function byte 1, or accessory number
+  uint8_t value2;     // Direction, function byte 2, or accessory activate
+};
+
 class DCCMain : public Waveform {
 public:
   DCCMain(uint8_t numDevices, Hardware hardware, Railcom railcom);
@@ -52,18 +110,57 @@ public:
 
   void loop() {
     Waveform::loop();
+    updateMomentum();
     updateSpeed();
     railcom.processData();
+    resendPOM();
+    updateLogon();
   }
 
+  // Sets the speed and direction of the device in a slot. If the slot has 
+  // momentum set, the speed ramps towards the new value from loop() instead 
+  // of changing straight away.
   uint8_t setThrottle(uint8_t slot, uint16_t addr, uint8_t speed, 
     uint8_t direction, setThrottleResponse& response);
+  // Stops a loco, or every loco if addr is zero, at the next packet boundary.
+  // Repeats of the packet going out are dropped along with queued speed 
+  // packets for the loco (or the whole queue for a broadcast stop), and the 
+  // speed table is zeroed so refresh doesn't start it again. A pending stop 
+  // is never replaced: if kEStopQueueSize are already waiting, every loco is
+  // stopped instead.
+  uint8_t emergencyStop(uint16_t addr, genericResponse& response);
+  // Microseconds from the last emergencyStop() call until its packet was 
+  // loaded for transmission.
+  uint32_t getEmergencyStopLatency() { return eStopLatency; }
+  // Number of packets whose repeats were dropped because the decoder sent a
+  // railcom ACK, and the number of packets that saved on the track.
+  uint16_t getAckCancels() { return ackCancels; }
+  uint32_t getRepeatsSaved() { return repeatsSaved; }
+  // Sets the acceleration and deceleration rates of a slot, in milliseconds 
+  // per speed step. A rate of zero changes speed immediately.
+  uint8_t setMomentum(uint8_t slot, uint16_t accelRate, uint16_t decelRate);
   uint8_t setFunction(uint16_t addr, uint8_t byte1, 
     genericResponse& response);
+  // Sets a feature expansion group, F13-F28 (byte1 0xDE or 0xDF) or F29-F68 
+  // (byte1 0xD8 to 0xDC).
   uint8_t setFunction(uint16_t addr, uint8_t byte1, uint8_t byte2, 
     genericResponse& response);
+  // Sets a binary state (0-32767) on or off in a single packet. Binary state
+  // zero sets every state on the decoder.
+  uint8_t setBinaryState(uint16_t addr, uint16_t state, bool value, 
+    genericResponse& response);
   uint8_t setAccessory(uint16_t addr, uint8_t number, bool activate, 
     genericResponse& response);
+  // Sends an 8-bit aspect to an extended accessory decoder (such as a 
+  // signal) at an 11-bit output address (0-2047).
+  uint8_t setExtendedAccessory(uint16_t addr, uint8_t aspect, 
+    genericResponse& response);
+  // Encodes a batch of throttle, function and accessory operations, then 
+  // publishes all of their packets to the queue in one critical section. 
+  // Returns ERR_BUSY without doing anything if they won't all fit in the 
+  // queue. response holds the transmit ID of the last packet.
+  uint8_t submitBatch(const batchOperation ops[], uint8_t count, 
+    genericResponse& response);
   // Writes a CV to a decoder on the main track and calls a callback function
   // if there is any railcom response to the request.
   uint8_t writeCVByteMain(uint16_t addr, uint16_t cv, uint8_t bValue, 
@@ -82,6 +179,39 @@ public:
   // with the four values.
   uint8_t readCVBytesMain(uint16_t addr, uint16_t cv, 
     genericResponse& response, void (*POMCallback)(RailcomPOMResponse));
+  // Writes 1-4 consecutive CVs, starting at cv (1-16777216), in a single XPOM 
+  // packet. Calls a callback function with the railcom reply, which holds the 
+  // sequence number the packet went out with.
+  uint8_t writeCVBytesXPOM(uint16_t addr, uint32_t cv, const uint8_t values[],
+    uint8_t count, genericResponse& response, 
+    void (*POMCallback)(RailcomPOMResponse));
+  // Reads four consecutive CVs, starting at cv (1-16777216), in a single XPOM 
+  // packet and calls a callback function with the four values.
+  uint8_t readCVBytesXPOM(uint16_t addr, uint32_t cv, 
+    genericResponse& response, void (*POMCallback)(RailcomPOMResponse));
+
+  // Starts DCC-A automatic logon. Decoders that answer are given long 
+  // addresses counting up from firstAddress, skipping ones in use, and put in
+  // the speed table. The callback is called as each decoder confirms its 
+  // address.
+  uint8_t startLogon(uint16_t firstAddress, 
+    void (*logonCallback)(const LogonDecoder&));
+  void stopLogon() { logonRunning = false; }
+  // Decoders found by automatic logon
+  LogonDecoder logonTable[kLogonDecoders];
+
+  // Adds a loco to an advanced consist by writing the consist address (1-127)
+  // to its CV19 on the main track. Speed commands for the loco go to the 
+  // consist address from then on.
+  uint8_t addToConsist(uint8_t consistAddr, uint16_t addr, bool reversed, 
+    genericResponse& response);
+  // Takes a loco out of its consist and clears its CV19.
+  uint8_t removeFromConsist(uint16_t addr, genericResponse& response);
+  // Breaks up a consist, clearing CV19 on every member.
+  uint8_t removeConsist(uint8_t consistAddr, genericResponse& response);
+  // Returns the address that speed packets for a loco should be sent to: the
+  // consist address if the loco is in a consist, otherwise its own address.
+  uint16_t getConsistAddress(uint16_t addr);
 
   uint8_t numDevices;
 
@@ -92,22 +222,63 @@ public:
     // TODO(davidcutting42@gmail.com): Merge these 2 variables into 1 uint8_t
     uint8_t speed;
     uint8_t forward;
+    // Speed and direction that updateMomentum() is ramping towards.
+    uint8_t targetSpeed;
+    uint8_t targetForward;
+    uint16_t accelRate;   // Milliseconds per step when speeding up
+    uint16_t decelRate;   // Milliseconds per step when slowing down
+    uint32_t lastStep;    // millis() when the speed last stepped
+    // Last instruction byte sent for each function group, refreshed along 
+    // with the speed.
+    uint8_t functions[kFunctionGroups];
+    uint16_t functionsSet;      // Bit n is set once group n has been sent
+    uint8_t nextFunctionGroup;  // Group to refresh next
   };
   // Speed table holds speed of all devices on the bus that have been set since
   // startup. 
   Speed* speedTable;
 
+  // Holds the members of an advanced consist.
+  struct Consist {
+    uint8_t address;    // Consist address in CV19, zero if the entry is free
+    uint16_t members[kMaxConsistMembers];   // Zero if the member is free
+    uint8_t reversed;   // Bit n is set if member n runs reversed
+  };
+  Consist consistTable[kMaxConsists];
+
   // Railcom object, complements hdw object inherited from Waveform
   Railcom railcom;
 
 private:
-  
+  // The logon simulation in extras/host watches the packets going out
+  friend class DCCMainHost;
 
   // Queues a packet for the next device in line reminding it of its speed.
   void updateSpeed();
   // Holds state for updateSpeed function.
   uint8_t nextDev = 0;
 
+  // Steps every device with momentum towards its target speed, and queues a 
+  // speed packet for each device whose speed step changed.
+  void updateMomentum();
+
+  // Queues a 128-step speed packet without touching the speed table.
+  void sendThrottle(uint16_t addr, uint8_t speed, uint8_t direction);
+  // Updates the speed table for a throttle command. Returns the address a 
+  // speed packet should go to straight away, or zero if momentum is going to
+  // ramp the speed instead.
+  uint16_t updateThrottle(uint8_t slot, uint16_t addr, uint8_t speed, 
+    uint8_t direction);
+  // Gives a slot a new address, starting from a standstill in the given 
+  // direction with no functions to refresh. Does nothing if the slot already 
+  // has the address.
+  void claimSlot(uint8_t slot, uint16_t addr, uint8_t direction);
+
+  // Records a function group in the speed table so updateSpeed() refreshes it
+  void storeFunctionGroup(uint16_t addr, uint8_t group, uint8_t value);
+  // Queues a single refresh of the next function group set in a slot
+  void refreshFunctions(uint8_t slot);
+
   struct Packet {
     uint8_t payload[kPacketMaxSize];
     uint8_t length;
@@ -120,14 +291,145 @@ private:
   PacketType transmitType = kIdleType;
   uint16_t transmitAddress = 0;
 
-  // Queue of packets, FIFO, that controls what gets sent out next. Size 5.
-  Queue<Packet, 5> packetQueue;
+  // Queue of packets, FIFO, that controls what gets sent out next.
+  Queue<Packet, kMainQueueSize> packetQueue;
 
+  void buildPacket(Packet& packet, const uint8_t buffer[], uint8_t byteCount, 
+    uint8_t repeats, uint16_t identifier, PacketType type, uint16_t address);
   void schedulePacket(const uint8_t buffer[], uint8_t byteCount, 
     uint8_t repeats, uint16_t identifier, PacketType type, uint16_t address);
+  // Pushes packets onto the queue in a single critical section. Returns false,
+  // having queued nothing, if there isn't room for all of them.
+  bool queuePackets(const Packet packets[], uint8_t count);
+
+  // Encodes an instruction to a multi-function decoder into a packet, giving 
+  // it a new transmit ID.
+  template<class T>
+  void buildInstruction(Packet& packet, uint16_t addr, const T& instruction, 
+    uint8_t repeats = T::repeats) {
+    uint8_t b[kPacketMaxSize];
+    uint16_t railcomAddr;
+    uint8_t nB = PacketEncoder::encode(addr, instruction, b, railcomAddr);
+
+    incrementCounterID();
+    buildPacket(packet, b, nB, repeats, counterID, T::type, railcomAddr);
+  }
+
+  // Encodes an instruction to a multi-function decoder and queues it. Returns
+  // the transmit ID given to the packet.
+  template<class T>
+  uint16_t scheduleInstruction(uint16_t addr, const T& instruction, 
+    uint8_t repeats = T::repeats) {
+    Packet packet;
+    buildInstruction(packet, addr, instruction, repeats);
+    queuePackets(&packet, 1);
+
+    return packet.transmitID;
+  }
+
+  // Queues a POM instruction and, if there is a callback and railcom is on, 
+  // opens a railcom transaction for its reply. Returns ERR_BUSY, having sent
+  // nothing, if the queue or the transaction table is full.
+  template<class T>
+  uint8_t schedulePOM(uint16_t addr, const T& instruction, uint8_t sequence, 
+    genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
+    bool track = POMCallback != nullptr && railcom.enable;
+    if(track && !railcom.POMSlotFree()) return ERR_BUSY;
+
+    // Railcom retries a tracked request that fails, so it doesn't need the 
+    // full set of repeats.
+    uint8_t repeats = T::repeats;
+    if(track) 
+      repeats = isPOMWrite(T::type) ? kPOMTrackedWriteRepeats : 
+        kPOMTrackedReadRepeats;
+
+    Packet packet;
+    buildInstruction(packet, addr, instruction, repeats);
+    if(!queuePackets(&packet, 1)) return ERR_BUSY;
+
+    response.transactionID = packet.transmitID;
+    if(track) {
+      int8_t i = railcom.openPOM(packet.transmitID, packet.address, T::type, 
+        sequence, POMCallback);
+      POMPackets[i] = packet;
+    }
+
+    return ERR_OK;
+  }
+
+  // Copies of the packets for open railcom POM transactions, by transaction
+  // index, so they can be sent again.
+  Packet POMPackets[kPOMTransactions];
+  // Queues any POM packet railcom wants sent again
+  void resendPOM();
+
+  // Queues an XPOM write of Count bytes
+  template<uint8_t Count>
+  uint8_t scheduleXPOMWrite(uint16_t addr, uint32_t cv, const uint8_t values[],
+    genericResponse& response, void (*POMCallback)(RailcomPOMResponse)) {
+    XPOMWriteInstruction<Count> instruction;
+    instruction.cv = cv;
+    instruction.sequence = nextXPOMSequence();
+    for(uint8_t i = 0; i < Count; i++) instruction.values[i] = values[i];
+
+    return schedulePOM(addr, instruction, instruction.sequence, response, 
+      POMCallback);
+  }
+
+  // Sequence number for the next XPOM packet, cycles through 0-3
+  uint8_t xpomSequence = 0;
+  uint8_t nextXPOMSequence() { 
+    uint8_t s = xpomSequence; 
+    xpomSequence = (xpomSequence + 1) & 0x03; 
+    return s; 
+  }
+
+  // Build the packets for setFunction() and setAccessory() without queuing 
+  // them, so submitBatch() can share them.
+  void buildFunction(Packet& packet, uint16_t addr, uint8_t byte1);
+  void buildFunction(Packet& packet, uint16_t addr, uint8_t byte1, 
+    uint8_t byte2);
+  void buildAccessory(Packet& packet, uint16_t addr, uint8_t number, 
+    bool activate);
+
+  // Automatic logon state
+  bool logonRunning = false;
+  uint8_t logonSession = 0;
+  uint16_t nextLogonAddress = 0;
+  uint32_t lastLogonEnable = 0;
+  void (*logonCallback)(const LogonDecoder&) = nullptr;
+  // Sends LOGON_ENABLE, assigns addresses to decoders that answer it, and 
+  // resends LOGON_ASSIGN to decoders that haven't confirmed
+  void updateLogon();
+  // Queues LOGON_ASSIGN for a decoder
+  void sendLogonAssign(LogonDecoder& decoder);
+  // Returns the next long address that no loco is using
+  uint16_t findFreeAddress();
+
+  // Emergency stop packets, loaded ahead of the queue by interrupt2()
+  Queue<Packet, kEStopQueueSize> eStopQueue;
+  volatile bool eStopLoaded = false;  // The packet going out is an e-stop
+  uint32_t eStopRequested = 0;    // micros() when emergencyStop() was called
+  volatile uint32_t eStopLatency = 0;
 
   bool interrupt1();
   void interrupt2();
+  // Loads a packet into the transmit variables. Called from interrupt2().
+  void loadPacket(const Packet& packet);
+  // Loads the next packet from the queue, or an idle packet if it's empty
+  void loadNextPacket();
+  // Drops the repeats of a packet its decoder has acknowledged. Called at the
+  // end of the cutout, while the preamble of the next packet goes out.
+  void cancelRepeats();
+
+  // The packet that was sent just before the cutout, which is the one any 
+  // railcom reply is for
+  uint16_t cutoutID = 0;
+  PacketType cutoutType = kIdleType;
+  uint16_t cutoutAddress = 0;
+
+  volatile uint16_t ackCancels = 0;
+  volatile uint32_t repeatsSaved = 0;
 
   // Railcom cutout variables
   // TODO(davidcutting42@gmail.com): Move these to the railcom class
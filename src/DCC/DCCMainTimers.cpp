@@ -65,8 +65,8 @@ bool DCCMain::interrupt1() {
     hdw.setBrake(false);      // Stop the cutout
     hdw.setSignal(LOW);     // Send out 29us of signal before case 0 flips it
     railcom.enableRecieve(false); // Turn off serial so we don't get garbage
-    // Read the data out and tag it with identifying info
-    railcom.readData(transmitID, transmitType, transmitAddress); 
+    // Read the data out and tag it with the packet the decoder is answering
+    if(railcom.readData(cutoutID, cutoutType, cutoutAddress)) cancelRepeats();
     generateRailcomCutout = false;    // Don't generate another railcom cutout
     inRailcomCutout = false;        // We aren't in a railcom pulse
     interruptState = 0;         // Go back to start of new bit
@@ -109,34 +109,69 @@ void DCCMain::interrupt2() {
       bytes_sent = 0;
       remainingPreambles = hdw.getPreambles() + 1;  // Add one for the stop bit
 
-      int pendingCount = packetQueue.count();
+      cutoutID = transmitID;
+      cutoutType = transmitType;
+      cutoutAddress = transmitAddress;
 
       // Note that the number of repeats does not include the final repeat, so
       // the number of times transmitted is nRepeats+1
-      if (transmitRepeats > 0) {
-        transmitRepeats--;
+      if (eStopQueue.count() > 0 && !(eStopLoaded && transmitRepeats > 0)) {
+        // An emergency stop goes out next, dropping any repeats left on the 
+        // current packet unless that's an emergency stop too
+        loadPacket(eStopQueue.pop());
+        eStopLoaded = true;
+        if (eStopQueue.count() == 0) 
+          eStopLatency = micros() - eStopRequested;
       }
-      else if (pendingCount > 0) {
-        // Copy pending packet to transmit packet
-        Packet pendingPacket = packetQueue.pop();
-
-        // Load info about the packet into the transmit variables.
-        // TODO(davidcutting42@gmail.com): check if this can be done with a 
-        // peek() into packetQueue intead.
-        for (int b=0;b<pendingPacket.length;b++) 
-          transmitPacket[b] = pendingPacket.payload[b];
-        transmitLength=pendingPacket.length;
-        transmitRepeats=pendingPacket.repeats;
-        transmitID=pendingPacket.transmitID;
-        transmitAddress=pendingPacket.address;
-        transmitType=pendingPacket.type;
+      else if (transmitRepeats > 0) {
+        transmitRepeats--;
       }
       else {
-        // Load an idle packet
-        memcpy(transmitPacket, kIdlePacket, sizeof(kIdlePacket));
-        transmitLength=sizeof(kIdlePacket);
-        transmitRepeats=0;
+        loadNextPacket();
       }
     }
   }
 }
+
+void DCCMain::loadNextPacket() {
+  eStopLoaded = false;
+  if (packetQueue.count() > 0) {
+    // Copy pending packet to transmit packet
+    // TODO(davidcutting42@gmail.com): check if this can be done with a 
+    // peek() into packetQueue intead.
+    loadPacket(packetQueue.pop());
+  }
+  else {
+    // Load an idle packet
+    memcpy(transmitPacket, kIdlePacket, sizeof(kIdlePacket));
+    transmitLength=sizeof(kIdlePacket);
+    transmitRepeats=0;
+    transmitID=0;
+    transmitType=kIdleType;
+    transmitAddress=0;
+  }
+}
+
+void DCCMain::cancelRepeats() {
+  // Only a repeat of the acknowledged packet can be dropped, and not for POM
+  // writes, which need two identical packets before the decoder acts.
+  if(cutoutID == 0 || transmitID != cutoutID || isPOMWrite(transmitType) || 
+    eStopQueue.count() > 0) return;
+
+  // The repeat is loaded but none of its bits have gone out yet, so it can 
+  // be swapped for the next packet.
+  repeatsSaved += transmitRepeats + 1;
+  ackCancels++;
+  loadNextPacket();
+}
+
+void DCCMain::loadPacket(const Packet& packet) {
+  // Load info about the packet into the transmit variables.
+  for (int b=0;b<packet.length;b++) 
+    transmitPacket[b] = packet.payload[b];
+  transmitLength=packet.length;
+  transmitRepeats=packet.repeats;
+  transmitID=packet.transmitID;
+  transmitAddress=packet.address;
+  transmitType=packet.type;
+}
@@ -23,25 +23,9 @@ DCCService::DCCService(Hardware settings) {
   this->hdw = settings; 
 }
 
-void DCCService::schedulePacket(const uint8_t buffer[], uint8_t byteCount, 
-  uint8_t repeats, uint16_t identifier) {
-  if(byteCount >= kPacketMaxSize) return; // allow for checksum
-  
-  Packet newPacket;
-
-  uint8_t checksum=0;
-  for (int b=0; b<byteCount; b++) {
-    checksum ^= buffer[b];
-    newPacket.payload[b] = buffer[b];
-  }
-  newPacket.payload[byteCount] = checksum;
-  newPacket.length = byteCount+1;
-  newPacket.repeats = repeats;
-  newPacket.transmitID = identifier;
-
-  const Packet pushPacket = newPacket;
+void DCCService::scheduleStep(const Step& step) {
   noInterrupts();
-  packetQueue.push(pushPacket);
+  packetQueue.push(step);
   interrupts();   
 }
 
@@ -50,52 +34,44 @@ uint8_t DCCService::writeCVByte(uint16_t cv, uint8_t bValue, uint16_t callback,
   
   // If we're in the middle of a read/write or if there's not room in the queue.
   if(ackNeeded != 0 || inVerify 
-    || (packetQueue.count() > (kServiceQueueSize - 8))) 
+    || (packetQueue.count() > (kServiceQueueSize - 4))) 
     return ERR_BUSY;
-  
-  uint8_t bWrite[4];
 
-  hdw.setBaseCurrent();
+  startAckDetection();
+  ackSpan = 1;    // The decoder may ACK as soon as the writes arrive
 
   cv--;       // actual CV addresses are cv-1 (0-1023)
 
   // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  bWrite[0]=0x7C+(highByte(cv)&0x03);                     
-  bWrite[1]=lowByte(cv);
-  bWrite[2]=bValue;
+  uint8_t write = 0x7C+(highByte(cv)&0x03);
+  uint8_t verify = 0x74+(highByte(cv)&0x03);    // re-verify entire byte
+  uint8_t cvLow = lowByte(cv);
 
   incrementCounterID();
-  // NMRA recommends starting with 3 reset packets (one plus two repeats)
-  schedulePacket(kResetPacket, 2, 2, counterID);           
-  // NMRA recommends 5 verify packets (one plue 4 repeats)
-  schedulePacket(bWrite, 3, 4, counterID);          
-  // NMRA recommends 6 write or reset packets for decoder recovery time 
-  // (one plus 5 repeats)      
-  schedulePacket(bWrite, 3, 5, counterID);                
+  // NMRA recommends starting with 3 reset packets, then 5 writes and 6 write 
+  // or reset packets for decoder recovery time (one plus 10 repeats)
+  scheduleStep({3, write, cvLow, bValue, 10, 0, counterID});
   
   incrementCounterID();
-   // set-up to re-verify entire byte
-  bWrite[0]=0x74+(highByte(cv)&0x03);                
-  // NMRA recommends starting with 3 reset packets (one plus two repeats)    
-  schedulePacket(kResetPacket, 2, 2, counterID);        
-  // We send 2 packets before looking for an ack (one plus one repeat)   
-  schedulePacket(bWrite, 3, 1, counterID);                
+  // NMRA recommends starting with 3 reset packets. We send 2 verify packets 
+  // before looking for an ack (one plus one repeat)
+  scheduleStep({3, verify, cvLow, bValue, 1, 0, counterID});
 
   incrementCounterID();
-  // NMRA recommends 5 verify packets - we sent 2, here are three more 
-  // (one plus two repeats)
-  schedulePacket(bWrite, 3, 2, counterID);           
-  // NMRA recommends 6 write or reset packets for decoder recovery time 
-  // (one plus five repeats)     
-  schedulePacket(bWrite, 3, 5, counterID);                
+  // NMRA recommends 5 verify packets - we sent 2, here are three more, and 6
+  // for decoder recovery time (one plus 8 repeats)
+  scheduleStep({0, verify, cvLow, bValue, 8, 0, counterID});
   
   ackPacketID[0] = counterID;
   
   incrementCounterID();
   // Final reset packet (and decoder begins to respond) (one plus no repeats)
-  schedulePacket(kResetPacket, 2, 0, counterID);           
+  scheduleStep({0, 0, 0, 0, 0, 0, counterID});
 
   inVerify = true;
+  // CV8 writes reset many decoders, so nothing cached can be trusted
+  if(cv+1 == 8) cvCache.clear();
+  else cvCache.invalidate(cv+1);
 
   cvState.type = WRITECV;
   cvState.callback = callback;
@@ -117,53 +93,46 @@ uint8_t DCCService::writeCVBit(uint16_t cv, uint8_t bNum, uint8_t bValue,
   
   // If we're in the middle of a read/write or if there's not room in the queue.
   if(ackNeeded != 0 || inVerify 
-    || (packetQueue.count() > (kServiceQueueSize - 8))) 
+    || (packetQueue.count() > (kServiceQueueSize - 4))) 
     return ERR_BUSY;
-  
-  byte bWrite[4];
 
-  hdw.setBaseCurrent();
+  startAckDetection();
+  ackSpan = 1;    // The decoder may ACK as soon as the writes arrive
 
   cv--;         // actual CV addresses are cv-1 (0-1023)
   bValue=bValue%2;
   bNum=bNum%8;
 
   // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  bWrite[0]=0x78+(highByte(cv)&0x03);   
-  bWrite[1]=lowByte(cv);
-  bWrite[2]=0xF0+bValue*8+bNum;
+  uint8_t instruction = 0x78+(highByte(cv)&0x03);
+  uint8_t cvLow = lowByte(cv);
+  uint8_t write = 0xF0+bValue*8+bNum;
+  uint8_t verify = write;
+  bitClear(verify,4);  // change instruction code from Write to Verify
 
   incrementCounterID();
-  // NMRA recommends starting with 3 reset packets (one plus two repeats)
-  schedulePacket(kResetPacket, 2, 2, counterID);          
-  // NMRA recommends 5 verify packets (one plue 4 repeats) 
-  schedulePacket(bWrite, 3, 4, counterID);                
-  // NMRA recommends 6 write or reset packets for decoder recovery time 
-  // (one plus 5 repeats)
-  schedulePacket(bWrite, 3, 5, counterID);                
+  // NMRA recommends starting with 3 reset packets, then 5 writes and 6 write 
+  // or reset packets for decoder recovery time (one plus 10 repeats)
+  scheduleStep({3, instruction, cvLow, write, 10, 0, counterID});
   
   incrementCounterID();
-  bitClear(bWrite[2],4);  // change instruction code from Write to Verify
-  // NMRA recommends starting with 3 reset packets (one plus two repeats)
-  schedulePacket(kResetPacket, 2, 2, counterID); 
-  // We send 2 packets before looking for an ack (one plus one repeat)
-  schedulePacket(bWrite, 3, 1, counterID);                
+  // NMRA recommends starting with 3 reset packets. We send 2 verify packets 
+  // before looking for an ack (one plus one repeat)
+  scheduleStep({3, instruction, cvLow, verify, 1, 0, counterID});
 
   incrementCounterID();
-  // NMRA recommends 5 verify packets - we already sent 2, here are three more 
-  // (one plus two repeats)
-  schedulePacket(bWrite, 3, 2, counterID);              
-  // NMRA recommends 6 write or reset packets for decoder recovery time 
-  // (one plus five repeats)  
-  schedulePacket(bWrite, 3, 5, counterID);                
+  // NMRA recommends 5 verify packets - we already sent 2, here are three more,
+  // and 6 for decoder recovery time (one plus 8 repeats)
+  scheduleStep({0, instruction, cvLow, verify, 8, 0, counterID});
   
   ackPacketID[0] = counterID;
   
   incrementCounterID();
   // Final reset packet (and decoder begins to respond) (one plus no repeats)
-  schedulePacket(kResetPacket, 2, 0, counterID);           
+  scheduleStep({0, 0, 0, 0, 0, 0, counterID});
 
   inVerify = true;
+  cvCache.invalidate(cv+1);
 
   cvState.type = WRITECVBIT;
   cvState.callback = callback;
@@ -181,64 +150,161 @@ uint8_t DCCService::writeCVBit(uint16_t cv, uint8_t bNum, uint8_t bValue,
 
 
 uint8_t DCCService::readCV(uint16_t cv, uint16_t callback, uint16_t callbackSub, 
-  void(*callbackFunc)(serviceModeResponse)) {
+  void(*callbackFunc)(serviceModeResponse), int hint) {
   
   // If we're in the middle of a read/write or if there's not room in the queue.
   if(ackNeeded != 0 || inVerify 
-    || (packetQueue.count() > (kServiceQueueSize - 25))) 
+    || (packetQueue.count() > (kServiceQueueSize - 16))) 
     return ERR_BUSY;
-  
-  uint8_t bRead[4];
 
-  hdw.setBaseCurrent();
+  cvState.type = READCV;
+  cvState.callback = callback;
+  cvState.callbackSub = callbackSub;
+  cvState.cv = cv;
 
+  cvResponse = callbackFunc;
+  readStarted = millis();
+
+  int cached = cvCache.get(cv);
+  if(cached < 0) cvCache.countMiss();
+  // The key CVs are always verified on the track, or a swapped decoder 
+  // with the same ones would never be noticed
+  else if(cvCache.isConfirmed() && !CVCache::isKey(cv)) {
+    cvCache.countHit();
+    cvState.cvValue = cached;
+    cvState.ackWidth = 0;
+    cvState.ackLatency = 0;
+    finishRead();
+    cvResponse(cvState);
+    return ERR_OK;
+  }
+
+  startAckDetection();
+
+  // A single byte verify of a value we can guess is much quicker than 
+  // reading the eight bits, so try that first.
+  int candidate = (hint >= 0 && hint <= 255) ? hint : knownValue(cv);
+  if(candidate >= 0) {
+    fastRead = true;
+    ackBuffer = candidate;
+    scheduleVerify(cv);
+  }
+  else {
+    fastRead = false;
+    scheduleBitReads(cv);
+  }
+
+  return ERR_OK;
+}
+
+int DCCService::knownValue(uint16_t cv) {
+  int cached = cvCache.get(cv);
+  if(cached >= 0) return cached;
+  if(cv == 1) return 3;     // Default short address
+  if(cv == 29) return 6;    // Default configuration, 28/128 steps, analog on
+  return -1;
+}
+
+void DCCService::scheduleBitReads(uint16_t cv) {
   cv--;    // actual CV addresses are cv-1 (0-1023)
 
   // any CV>1023 will become modulus(1024) due to bit-mask of 0x03
-  bRead[0]=0x78+(highByte(cv)&0x03);            
-  bRead[1]=lowByte(cv);
+  uint8_t instruction = 0x78+(highByte(cv)&0x03);
+  uint8_t cvLow = lowByte(cv);
   
-  // Queue up all unique packets required for the CV read. 
-  for(int i=0;i<8;i++) {                                  
-    bRead[2]=0xE8+i;
+  // Queue up all steps required for the CV read. 
+  for(uint8_t i=0;i<8;i++) {                                  
+    uint8_t verify = 0xE8+i;
 
     incrementCounterID();
-    // NMRA recommends starting with 3 reset packets (one plue two repeats)
-    schedulePacket(kResetPacket, 2, 2, counterID);       
-    // We send 2 packets before looking for an ack (one plus one repeat)
-    schedulePacket(bRead, 3, 1, counterID);             
+    // NMRA recommends starting with 3 reset packets. We send 2 verify packets
+    // before looking for an ack (one plus one repeat)
+    scheduleStep({3, instruction, cvLow, verify, 1, 0, counterID});
 
     incrementCounterID();
-    // NMRA recommends 5 verify packets - we already sent 2, here are three more 
-    // (one plus two repeats)
-    schedulePacket(bRead, 3, 2, counterID);             
+    // NMRA recommends 5 verify packets - we already sent 2, here are three 
+    // more (one plus two repeats), then 1 reset packet after checking for an
+    // ACK
+    scheduleStep({0, instruction, cvLow, verify, 2, 1, counterID});
 
     ackPacketID[i] = counterID;
-
-    incrementCounterID();
-    // NMRA recommends 1 reset packet after checking for an ACK 
-    // (one and no repeats)
-    schedulePacket(kResetPacket, 2, 0, counterID);       
   }
 
   ackNeeded = 0b11111111;
-  
-  cvState.type = READCV;
-  cvState.callback = callback;
-  cvState.callbackSub = callbackSub;
-  cvState.cv = cv+1;
+  // A bit's ACK may start with the first verify, before ackPacketID[i]
+  ackSpan = 1;
+
+  backToIdle = false;
+}
+
+void DCCService::scheduleVerify(uint16_t cv) {
+  cv--;    // actual CV addresses are cv-1 (0-1023)
+
+  // set-up to re-verify entire byte
+  uint8_t verify = 0x74+(highByte(cv)&0x03);
+
+  incrementCounterID();               
+  // Load 3 reset packets, 5 verify packets and 1 reset packet
+  scheduleStep({3, verify, lowByte(cv), ackBuffer, 4, 1, counterID});
+
+  ackPacketID[0] = counterID;
 
-  verifyPayload[0]=0x74+(highByte(cv)&0x03);  // set-up to re-verify entire byte
-  verifyPayload[1]=lowByte(cv);
-  // verifyPayload[2] and verifyPayload[3] get set in checkAck when verifying 
+  incrementCounterID();
+  // We need one additional packet with incremented counter so ACK 
+  // completes and doesn't hang in checkAck()
+  scheduleStep({0, 0, 0, 0, 0, 0, counterID});
 
+  ackSpan = 0;
+  inVerify = true;
   backToIdle = false;
+}
 
-  cvResponse = callbackFunc;
+void DCCService::finishRead() {
+  uint16_t elapsed = millis() - readStarted;
+  readStats.reads++;
+  readStats.totalMillis += elapsed;
+  readStats.lastMillis = elapsed;
+  if(cvState.cvValue < 0) readStats.failures++;
+}
+
+uint8_t DCCService::submitJobs(const serviceJob jobs[], uint8_t count, 
+  void(*callbackFunc)(serviceModeResponse)) {
+  
+  if(count > kServiceJobQueueSize - jobQueue.count()) return ERR_BUSY;
+
+  for(uint8_t i = 0; i < count; i++) jobQueue.push(jobs[i]);
+  jobResponse = callbackFunc;
 
   return ERR_OK;
 }
 
+void DCCService::runJobs() {
+  if(jobQueue.count() == 0 || ackNeeded != 0 || inVerify) return;
+
+  // Each call returns ERR_BUSY until the previous job's packets have drained
+  // from the packet queue, so the job stays queued until it has started.
+  serviceJob job = jobQueue.peek();
+  uint8_t result;
+  switch(job.type) {
+  case READCV:
+    result = readCV(job.cv, job.callback, job.callbackSub, jobResponse);
+    break;
+  case WRITECV:
+    result = writeCVByte(job.cv, job.value, job.callback, job.callbackSub, 
+      jobResponse);
+    break;
+  case WRITECVBIT:
+    result = writeCVBit(job.cv, job.bitNum, job.value, job.callback, 
+      job.callbackSub, jobResponse);
+    break;
+  default:
+    result = ERR_OK;    // Drop anything we don't understand
+    break;
+  }
+
+  if(result == ERR_OK) jobQueue.pop();
+}
+
 void DCCService::checkAck() {
   // If the unique ID counter has wrapped, cancel the current read/write 
   // operation. This shouldn't happen very often.
@@ -247,12 +313,17 @@ void DCCService::checkAck() {
     inVerify = false;
     ackNeeded = 0;
     cvState.cvValue = -1;
+    if(cvState.type == READCV) finishRead();
     cvResponse(cvState);
     return;
   } 
   
   if(!inVerify && (ackNeeded == 0)) return;
-  float currentMilliamps = hdw.getMilliamps();
+
+  if(calibrated) reportCalibration();
+  bool inPulse;
+  uint16_t acked = takeAck(inPulse);
+  uint16_t compareID = transmitID;
 
   if(!inVerify) {
     uint16_t currentAckID;
@@ -261,77 +332,142 @@ void DCCService::checkAck() {
       if(!bitRead(ackNeeded, i)) continue;  // We don't need an ack on this bit
 
       currentAckID = ackPacketID[i];
-      uint16_t compareID = transmitID;
-      if(currentAckID == compareID) {
-        if((currentMilliamps - hdw.getBaseCurrent()) > kACKThreshold) {
-          bitSet(ackBuffer, i);       // We got an ack on this bit
-          bitClear(ackNeeded, i);     // We no longer need an ack on this bit
-
-          // Fast-forward to the next packet set
-          noInterrupts();
-          transmitRepeats = 0;    // Stop transmitting current packet
-          while(packetQueue.peek().transmitID == currentAckID) {
-            packetQueue.pop();  // Pop off all packets with the the same ID
-          }
-          interrupts();
-        }
+      if(isAckFor(acked, currentAckID)) {
+        bitSet(ackBuffer, i);       // We got an ack on this bit
+        bitClear(ackNeeded, i);     // We no longer need an ack on this bit
+
+        skipWindow(currentAckID);   // Fast-forward to the next step
       }
       
-      else if(compareID > currentAckID || backToIdle) {    
+      // A pulse under way may still turn out to be this bit's ACK
+      else if((compareID > currentAckID || backToIdle) && !inPulse) {    
         bitClear(ackBuffer, i);  // We didn't get an ack on this bit (timeout)
         bitClear(ackNeeded, i);  // We no longer need an ack on this bit
       }
 
       if(ackNeeded == 0) {        // If we've now gotten all the ACKs we need 
-        if(cvState.type == READCV) {
-          verifyPayload[2] = ackBuffer;   // Set up the verifyPayload for verify
-        
-          incrementCounterID();               
-          // Load 3 reset packets
-          schedulePacket(kResetPacket, 2, 2, counterID); 
-          // Load 5 verify packets
-          schedulePacket(verifyPayload, 3, 4, counterID);     
-          // Load 1 Reset packet
-          schedulePacket(kResetPacket, 2, 0, counterID);       
-
-          ackPacketID[0] = counterID;
-
-          incrementCounterID();
-          // We need one additional packet with incremented counter so ACK 
-          // completes and doesn't hang in checkAck()
-          schedulePacket(kResetPacket, 2, 0, counterID);   
-
-          inVerify = true;
-          backToIdle = false;
-        }
+        if(cvState.type == READCV) scheduleVerify(cvState.cv);
         break;
       }
     }    
   }
   else {
-    uint16_t compareID = transmitID;
-    if(ackPacketID[0] == compareID) {
-      if((currentMilliamps - hdw.getBaseCurrent()) > kACKThreshold) {
-        inVerify = false;
-        if(cvState.type == READCV)
-          cvState.cvValue = ackBuffer;
-        cvResponse(cvState);
-
-        // Fast-forward to the next packet set
-        noInterrupts();
-        transmitRepeats = 0;  // Stop transmitting current packet
-        while(packetQueue.peek().transmitID == ackPacketID[0]) {
-          packetQueue.pop();  // Pop off all packets with the the same ID
-        }
-        interrupts();
+    if(isAckFor(acked, ackPacketID[0])) {
+      inVerify = false;
+      if(cvState.type == READCV) {
+        cvState.cvValue = ackBuffer;
+        if(fastRead) readStats.fastHits++;
+        finishRead();
+        cvCache.readBack(cvState.cv, ackBuffer);
       }
+      else if(cvState.type == WRITECV) 
+        cvCache.written(cvState.cv, cvState.cvValue);
+      cvResponse(cvState);
+
+      skipWindow(ackPacketID[0]);   // Fast-forward to the next step
     }
     
-    else if(compareID > ackPacketID[0] || backToIdle) {
+    else if((compareID > ackPacketID[0] || backToIdle) && !inPulse) {
       inVerify = false;
+
+      // The guess was wrong, so read the CV a bit at a time after all
+      if(cvState.type == READCV && fastRead) {
+        fastRead = false;
+        readStats.fastMisses++;
+        scheduleBitReads(cvState.cv);
+        return;
+      }
       
       cvState.cvValue = -1;
+      if(cvState.type == READCV) {
+        finishRead();
+        cvCache.expire();   // Maybe no decoder, or a different one
+      }
       cvResponse(cvState);
     }
   }
-}
\ No newline at end of file
+}
+
+void DCCService::checkCacheExpiry() {
+  if(ackNeeded != 0 || inVerify) lastActive = millis();
+  // Locos are swapped with the power off, or while the track is idle
+  else if(!hdw.getStatus() || millis() - lastActive > kCVCacheIdleTimeout)
+    cvCache.expire();
+}
+
+void DCCService::skipWindow(uint16_t id) {
+  noInterrupts();
+  // The ACK is only known once the pulse ends, by which time the next step 
+  // may have started, and that one has to go out in full.
+  if(transmitID == id) {
+    transmitRepeats = 0;      // Stop transmitting current packet
+    stepPhase = kPhaseDone;   // and the rest of the step
+  }
+  while(packetQueue.count() > 0 && packetQueue.peek().transmitID == id) {
+    packetQueue.pop();  // Pop off all steps with the the same ID
+  }
+  interrupts();
+}
+
+void DCCService::startAckDetection() {
+  minMargin = hdw.milliampsToReading(kACKThreshold);
+  maxMargin = hdw.milliampsToReading(kACKMaxThreshold);
+
+  noInterrupts();
+  calibrationSum = 0;
+  calibrationCount = 0;
+  calibrationPeak = 0;
+  calibrated = false;
+  ackPulseState = kAckCalibrating;
+  ackReady = false;
+  interrupts();
+
+  cvState.ackWidth = 0;
+  cvState.ackLatency = 0;
+  cvState.baseMilliamps = 0;
+  cvState.thresholdMilliamps = 0;
+}
+
+void DCCService::reportCalibration() {
+  noInterrupts();
+  uint16_t base = baseLevel;
+  uint16_t level = ackLevel;
+  uint16_t peak = calibrationPeak;
+  calibrated = false;
+  interrupts();
+
+  cvState.baseMilliamps = hdw.getMilliamps(base);
+  cvState.thresholdMilliamps = hdw.getMilliamps(level - base);
+
+  ackStats.baseMilliamps = cvState.baseMilliamps;
+  ackStats.noiseMilliamps = hdw.getMilliamps(peak - base);
+  ackStats.thresholdMilliamps = cvState.thresholdMilliamps;
+}
+
+uint16_t DCCService::takeAck(bool& inPulse) {
+  ackStats.rejected = ackRejected;
+
+  // Both in one go, or a pulse could end between them and neither be seen
+  noInterrupts();
+  inPulse = (ackPulseState == kAckInPulse);
+  if(!ackReady) {
+    interrupts();
+    return 0;
+  }
+  uint16_t id = ackID;
+  uint16_t width = ackWidthTicks;
+  uint16_t latency = ackLatencyTicks;
+  ackReady = false;
+  interrupts();
+
+  cvState.ackWidth = width * kServiceTickMicros;
+  // Capped so it still prints as an int
+  cvState.ackLatency = latency > 0x7FFF / kServiceTickMicros ? 0x7FFF 
+    : latency * kServiceTickMicros;
+
+  ackStats.accepted++;
+  ackStats.lastWidth = cvState.ackWidth;
+  ackStats.lastLatency = cvState.ackLatency;
+
+  return id;
+}
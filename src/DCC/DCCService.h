@@ -22,13 +22,35 @@
 
 #include <Arduino.h>
 
-#include "Waveform.h"
+#include "CVCache.h"
 #include "Queue.h"
+#include "Waveform.h"
 
-const uint8_t kServiceQueueSize = 35;
+// Steps a readCV() takes, the longest operation, plus the verify that follows
+const uint8_t kServiceQueueSize = 18;
 
-// Threshold (mA) that a sample must cross to ACK
+// Number of read/write jobs that can wait for the programming track
+const uint8_t kServiceJobQueueSize = 16;
+
+// Least and most (mA) above the base current that a sample must be to ACK.
+// NMRA decoders ACK with at least 60mA.
 const uint8_t kACKThreshold = 30; 
+const uint8_t kACKMaxThreshold = 50;
+
+// The base current is measured over this many samples (a power of two) while
+// the reset packets at the start of an operation go out, and the threshold is
+// set kACKNoiseMargin times the noise above it, between the two limits above.
+const uint8_t kACKCalibrationShift = 5;
+const uint8_t kACKCalibrationSamples = 1 << kACKCalibrationShift;
+const uint8_t kACKNoiseMargin = 2;
+
+// Time between waveform interrupts (us)
+const uint8_t kServiceTickMicros = 29;
+
+// NMRA S-9.2.3 asks for a 6ms +/- 1ms ACK pulse. Decoders stray outside that,
+// so a little either side is accepted.
+const uint16_t kACKMinTicks = 4000 / kServiceTickMicros;
+const uint16_t kACKMaxTicks = 8500 / kServiceTickMicros;
 
 enum cv_edit_type : uint8_t {
   READCV,
@@ -43,6 +65,46 @@ struct serviceModeResponse {
   uint16_t cv;
   uint8_t cvBitNum;
   int cvValue;  // Might be -1, so int works
+  // Last ACK pulse of the operation (us), zero if there wasn't one. Latency
+  // is from the start of the packets the ACK answered to the pulse starting.
+  uint16_t ackWidth;
+  uint16_t ackLatency;
+  // Calibration of the ACK detector for this operation (mA)
+  uint16_t baseMilliamps;
+  uint16_t thresholdMilliamps;  // Above the base current
+};
+
+// ACK pulses seen on the programming track
+struct serviceAckStats {
+  uint16_t accepted;
+  uint16_t rejected;      // Too short or too long to be an ACK
+  uint16_t lastWidth;     // us
+  uint16_t lastLatency;   // us
+  // Last calibration (mA)
+  uint16_t baseMilliamps;
+  uint16_t noiseMilliamps;      // Peak above the base current
+  uint16_t thresholdMilliamps;
+};
+
+// Counts and timing of readCV() calls
+struct serviceReadStats {
+  uint16_t reads;
+  uint16_t failures;      // Reads that got no value
+  uint16_t fastHits;      // Reads answered by verifying a known value
+  uint16_t fastMisses;    // Known values that were wrong
+  uint32_t totalMillis;
+  uint16_t lastMillis;    // Time taken by the last read
+};
+
+// A read or write waiting to run on the programming track. The response 
+// carries the callback numbers it was submitted with.
+struct serviceJob {
+  cv_edit_type type;
+  uint16_t cv;
+  uint8_t value;      // Writes only
+  uint8_t bitNum;     // WRITECVBIT only
+  uint16_t callback;
+  uint16_t callbackSub;
 };
 
 class DCCService : public Waveform {
@@ -60,6 +122,8 @@ public:
   void loop() {
     Waveform::loop(); // Checks for overcurrent and manages power
     checkAck();
+    runJobs();
+    checkCacheExpiry();
   }
 
   uint8_t writeCVByte(uint16_t cv, uint8_t bValue, uint16_t callback, 
@@ -67,37 +131,139 @@ public:
   uint8_t writeCVBit(uint16_t cv, uint8_t bNum, uint8_t bValue, 
     uint16_t callback, uint16_t callbackSub, 
     void(*callbackFunc)(serviceModeResponse));
+  // Reads a CV. A cached value is returned straight away once the decoder's
+  // identity has been confirmed (see CVCache). Otherwise, if the value can be
+  // guessed, from hint (0-255), the cache, or a common default, a byte verify
+  // of that value goes first and the CV is only read bit by bit if it doesn't
+  // ACK.
   uint8_t readCV(uint16_t cv, uint16_t callback, uint16_t callbackSub, 
+    void(*callbackFunc)(serviceModeResponse), int hint = -1);
+
+  // Queues jobs to run one after another, each calling callbackFunc when it
+  // finishes. Either all of them are queued or, if there isn't room, none 
+  // are and ERR_BUSY is returned.
+  uint8_t submitJobs(const serviceJob jobs[], uint8_t count, 
     void(*callbackFunc)(serviceModeResponse));
+  // Drops the jobs that haven't started yet
+  void cancelJobs() { jobQueue.clear(); }
+  uint8_t getJobsWaiting() { return jobQueue.count(); }
+
+  const serviceReadStats& getReadStats() { return readStats; }
+  const serviceAckStats& getAckStats() { return ackStats; }
+
+  // Values read from and written to the decoder on the programming track
+  CVCache cvCache;
 
 private:
-  struct Packet {
-    uint8_t payload[kPacketMaxSize];
-    uint8_t length;
+  // One step of a service mode sequence, which the interrupt turns into 
+  // packets as it goes: resetsBefore reset packets, the instruction packet
+  // (instruction, cv, data) repeats+1 times, then resetsAfter resets. An 
+  // instruction of zero sends reset packets instead. Steps sharing a 
+  // transmitID make up one ACK window, and checkAck() skips the rest of the
+  // window once the decoder ACKs.
+  struct Step {
+    uint8_t resetsBefore;
+    uint8_t instruction;
+    uint8_t cv;           // Low byte, the high bits are in instruction
+    uint8_t data;
     uint8_t repeats;
+    uint8_t resetsAfter;
     uint16_t transmitID;  // Identifier for CV programming
   };
 
-  // Queue of packets, FIFO, that controls what gets sent out next. Size 35.
-  Queue<Packet, kServiceQueueSize> packetQueue;
+  // Queue of steps, FIFO, that controls what gets sent out next.
+  Queue<Step, kServiceQueueSize> packetQueue;
 
-  void schedulePacket(const uint8_t buffer[], uint8_t byteCount, 
-    uint8_t repeats, uint16_t identifier);
+  void scheduleStep(const Step& step);
+
+  // The step going out, and how far through it the interrupt is
+  Step currentStep;
+  enum : uint8_t { 
+    kPhaseResetsBefore, kPhaseCommand, kPhaseResetsAfter, kPhaseDone 
+  };
+  uint8_t stepPhase = kPhaseDone;
+  // Loads the next packet of currentStep, returning false at the end of it
+  bool loadPhase();
+  void loadReset(uint8_t repeats);
+  // Drops what's left of the steps with this ID once it has been ACKed
+  void skipWindow(uint16_t id);
 
   bool interrupt1();
   void interrupt2();
 
-  // Checks service mode track for an ACK pulse, and handles state of ACK engine
+  // Handles ACK pulses found by detectAck(), and the state of the ACK engine
   void checkAck();
+
+  // ACK pulse detector, run from interrupt1() while an operation is going on.
+  // A pulse is timed from the first sample above ackLevel to the first one 
+  // below it, and counts if its width is in the ACK window. It belongs to the
+  // packets that were going out when it started.
+  void detectAck();
+  // Resets the detector for a new operation, starting with calibration
+  void startAckDetection();
+  enum : uint8_t { kAckCalibrating, kAckIdle, kAckInPulse, kAckTooLong };
+  volatile uint8_t ackPulseState = kAckIdle;
+  volatile uint16_t tick = 0;         // Counts interrupts, wraps
+  uint16_t ackLevel;                  // Raw reading that counts as high
+  // Calibration, in raw readings
+  uint16_t minMargin;                 // kACKThreshold
+  uint16_t maxMargin;                 // kACKMaxThreshold
+  uint32_t calibrationSum;
+  uint8_t calibrationCount;
+  uint16_t calibrationPeak;
+  volatile uint16_t baseLevel;
+  volatile bool calibrated = false;   // Waiting for reportCalibration()
+  // Adds the calibration to cvState and ackStats
+  void reportCalibration();
+  uint16_t pulseStart;                // tick the pulse started
+  uint16_t pulseID;                   // transmitID when it started
+  uint16_t pulseLatency;              // Ticks from packet to pulse start
+  volatile uint16_t idStartTick = 0;  // tick the current transmitID started
+  // A pulse that passed, waiting for checkAck()
+  volatile bool ackReady = false;
+  volatile uint16_t ackID;
+  volatile uint16_t ackWidthTicks;
+  volatile uint16_t ackLatencyTicks;
+  volatile uint16_t ackRejected = 0;
+  // How many packet IDs before ackPacketID[] an ACK may start in. The 
+  // decoder can answer the first of the packets it acts on.
+  uint8_t ackSpan = 0;
+  // Takes the pulse detectAck() found, returning the ID it belongs to or 0,
+  // and whether another pulse is under way
+  uint16_t takeAck(bool& inPulse);
+  bool isAckFor(uint16_t acked, uint16_t id) {
+    return acked != 0 && acked <= id && acked + ackSpan >= id;
+  }
+  serviceAckStats ackStats = {};
   serviceModeResponse cvState;
   uint8_t ackBuffer; // Bits keeps track of what the ack values are.
   uint8_t ackNeeded = 0; // Bits denote where we still need an ack.
   uint16_t ackPacketID[8]; // Packet IDs that correspond to ACK opportunities
-  uint8_t verifyPayload[4]; // Packet sent to confirm CV read
   uint8_t inVerify = false;   // (bool) Set when verifying read/write
   uint8_t backToIdle;  // (bool) Gone back to idle after setting CV instruction?
   // Callback function, returns response to comm API.
   void (*cvResponse)(serviceModeResponse);    
+
+  // Known value fast path for readCV()
+  bool fastRead = false;  // The verify going out is a guess at the value
+  // Returns a likely value for a CV, or -1 if there isn't one
+  int knownValue(uint16_t cv);
+  // Queue the eight bit verifies of a CV read, or a byte verify of ackBuffer
+  void scheduleBitReads(uint16_t cv);
+  void scheduleVerify(uint16_t cv);
+
+  Queue<serviceJob, kServiceJobQueueSize> jobQueue;
+  void (*jobResponse)(serviceModeResponse) = nullptr;
+  // Starts the next job once the track is free
+  void runJobs();
+
+  serviceReadStats readStats = {};
+  uint32_t readStarted = 0;   // millis() when the current read started
+  uint32_t lastActive = 0;    // millis() when the track was last busy
+  // Expires cvCache once the decoder on the track may have been swapped
+  void checkCacheExpiry();
+  // Adds the read that just finished to readStats
+  void finishRead();
 };
 
 #endif
\ No newline at end of file
@@ -20,6 +20,9 @@
 #include "DCCService.h"
 
 bool DCCService::interrupt1() {
+  tick++;
+  if(ackNeeded != 0 || inVerify) detectAck();
+
   switch (interruptState) {
   case 0:   // start of bit transmission
     hdw.setSignal(HIGH);    
@@ -55,6 +58,100 @@ bool DCCService::interrupt1() {
   return false;   // Don't call interrupt2
 }
 
+void DCCService::detectAck() {
+  if(!hdw.pollSample()) return;
+
+  bool high = hdw.getSample() > ackLevel;
+  uint16_t width = tick - pulseStart;
+
+  switch(ackPulseState) {
+  case kAckCalibrating:
+    calibrationSum += hdw.getSample();
+    if(hdw.getSample() > calibrationPeak) calibrationPeak = hdw.getSample();
+    if(++calibrationCount < kACKCalibrationSamples) break;
+    {
+      uint16_t mean = calibrationSum >> kACKCalibrationShift;
+      uint16_t margin = (calibrationPeak - mean) * kACKNoiseMargin;
+      if(margin < minMargin) margin = minMargin;
+      if(margin > maxMargin) margin = maxMargin;
+      baseLevel = mean;
+      ackLevel = mean + margin;
+    }
+    calibrated = true;
+    ackPulseState = kAckIdle;
+    break;
+  case kAckIdle:
+    if(high) {
+      ackPulseState = kAckInPulse;
+      pulseStart = tick;
+      pulseID = transmitID;
+      pulseLatency = tick - idStartTick;
+    }
+    break;
+  case kAckInPulse:
+    if(high && width <= kACKMaxTicks) break;
+    if(high) {
+      // Held on too long, probably a motor. Wait for it to stop.
+      ackPulseState = kAckTooLong;
+      ackRejected++;
+      break;
+    }
+    ackPulseState = kAckIdle;
+    if(width < kACKMinTicks) ackRejected++;
+    else if(!ackReady) {
+      ackID = pulseID;
+      ackWidthTicks = width;
+      ackLatencyTicks = pulseLatency;
+      ackReady = true;
+    }
+    break;
+  case kAckTooLong:
+    if(!high) ackPulseState = kAckIdle;
+    break;
+  }
+}
+
+bool DCCService::loadPhase() {
+  switch(stepPhase) {
+  case kPhaseResetsBefore:
+    stepPhase = kPhaseCommand;
+    if(currentStep.resetsBefore > 0) {
+      loadReset(currentStep.resetsBefore - 1);
+      return true;
+    }
+    // Fall through - there are no resets to send
+  case kPhaseCommand:
+    stepPhase = kPhaseResetsAfter;
+    if(currentStep.instruction == 0) {
+      loadReset(currentStep.repeats);
+      return true;
+    }
+    transmitPacket[0] = currentStep.instruction;
+    transmitPacket[1] = currentStep.cv;
+    transmitPacket[2] = currentStep.data;
+    transmitPacket[3] = currentStep.instruction ^ currentStep.cv 
+      ^ currentStep.data;
+    transmitLength = 4;
+    transmitRepeats = currentStep.repeats;
+    return true;
+  case kPhaseResetsAfter:
+    stepPhase = kPhaseDone;
+    if(currentStep.resetsAfter > 0) {
+      loadReset(currentStep.resetsAfter - 1);
+      return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+void DCCService::loadReset(uint8_t repeats) {
+  memcpy(transmitPacket, kResetPacket, sizeof(kResetPacket));
+  transmitLength = sizeof(kResetPacket);
+  transmitRepeats = repeats;
+}
+
 void DCCService::interrupt2() {
   if (remainingPreambles > 0 ) {    // If there's more preambles to be sent
     currentBit=true;                // Send a one bit (preambles are one)
@@ -77,31 +174,23 @@ void DCCService::interrupt2() {
       bytes_sent = 0;
       remainingPreambles = hdw.getPreambles() + 1;  // Add one for the stop bit
 
-      int pendingCount = packetQueue.count();
-
       // Note that the number of repeats does not include the final repeat, so
       // the number of times transmitted is nRepeats+1
       if (transmitRepeats > 0) {
         transmitRepeats--;
       }
-      else if (pendingCount > 0) {
-        // Copy pending packet to transmit packet
-        Packet pendingPacket = packetQueue.pop();
-
-        // Load info about the packet into the transmit variables.
-        // TODO(davidcutting42@gmail.com): check if this can be done with a 
-        // peek() into packetQueue intead.
-        for (int b=0;b<pendingPacket.length;b++) 
-          transmitPacket[b] = pendingPacket.payload[b];
-        transmitLength=pendingPacket.length;
-        transmitRepeats=pendingPacket.repeats;
-        transmitID=pendingPacket.transmitID;
+      else if (loadPhase()) {
+        // Still going through the current step
+      }
+      else if (packetQueue.count() > 0) {
+        currentStep = packetQueue.pop();
+        if(transmitID != currentStep.transmitID) idStartTick = tick;
+        transmitID = currentStep.transmitID;
+        stepPhase = kPhaseResetsBefore;
+        loadPhase();
       }
       else {
-        // Load a reset packet
-        memcpy( transmitPacket, kResetPacket, sizeof(kResetPacket));
-        transmitLength=sizeof(kResetPacket);
-        transmitRepeats=0;
+        loadReset(0);
         backToIdle = true;
       }
     }
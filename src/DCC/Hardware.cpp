@@ -80,6 +80,82 @@ float Hardware::getMilliamps(uint32_t reading) {
   #endif
 }
 
+uint16_t Hardware::milliampsToReading(float milliamps) {
+  #if defined(ARDUINO_ARCH_AVR)   
+    return milliamps * 1023.0 / (5 * 1000 * amps_per_volt);
+  #elif defined(ARDUINO_ARCH_SAMD)
+    return milliamps * 4095.0 / (3.3 * 1000 * amps_per_volt);
+  #else
+    #error "Cannot compile - invalid architecture for current sensing"
+  #endif
+}
+
+volatile bool Hardware::adcInUse = false;
+Hardware* volatile Hardware::sampler = NULL;
+
+uint32_t Hardware::readCurrent() {
+  adcInUse = true;    // Stops pollSample() starting another conversion
+  if(sampler != NULL) {
+    while(!conversionDone());
+    sampler = NULL;   // The result is dropped, analogRead() is about to reuse it
+  }
+  uint32_t result = analogRead(current_sense_pin);
+  adcInUse = false;
+  return result;
+}
+
+bool Hardware::pollSample() {
+  bool ready = false;
+  if(sampler == this && conversionDone()) {
+    sample = conversionResult();
+    sampler = NULL;
+    ready = true;
+  }
+  if(sampler == NULL && !adcInUse) {
+    sampler = this;
+    startConversion();
+  }
+  return ready;
+}
+
+// These do what analogRead() does, without waiting for the result
+void Hardware::startConversion() {
+#if defined(ARDUINO_ARCH_AVR)
+  uint8_t channel = current_sense_pin >= A0 ? current_sense_pin - A0 
+    : current_sense_pin;
+#if defined(MUX5)
+  ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+#endif
+  ADMUX = _BV(REFS0) | (channel & 0x07);    // AVcc reference, the default
+  ADCSRA |= _BV(ADSC);
+#elif defined(ARDUINO_ARCH_SAMD)
+  while(ADC->STATUS.bit.SYNCBUSY == 1);
+  ADC->INPUTCTRL.bit.MUXPOS = 
+    g_APinDescription[current_sense_pin].ulADCChannelNumber;
+  // analogRead() turns the ADC off after each reading
+  ADC->CTRLA.bit.ENABLE = 1;
+  while(ADC->STATUS.bit.SYNCBUSY == 1);
+  ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+  ADC->SWTRIG.bit.START = 1;
+#endif
+}
+
+bool Hardware::conversionDone() {
+#if defined(ARDUINO_ARCH_AVR)
+  return !(ADCSRA & _BV(ADSC));
+#elif defined(ARDUINO_ARCH_SAMD)
+  return ADC->INTFLAG.bit.RESRDY;
+#endif
+}
+
+uint16_t Hardware::conversionResult() {
+#if defined(ARDUINO_ARCH_AVR)
+  return ADC;
+#elif defined(ARDUINO_ARCH_SAMD)
+  return ADC->RESULT.reg;
+#endif
+}
+
 void Hardware::checkCurrent() {
   // if we have exceeded the CURRENT_SAMPLE_TIME we need to check if we are 
   // over/under current.
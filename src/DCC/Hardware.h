@@ -65,9 +65,17 @@ public:
   float getLastRead() { return reading; }
   float getLastMilliamps() { return current; }
   float getMilliamps() { return getMilliamps(readCurrent()); }
-  
-  void setBaseCurrent() { baseMilliamps = getMilliamps(readCurrent()); }
-  float getBaseCurrent() { return baseMilliamps; }
+  float getMilliamps(uint32_t reading);
+
+  // Raw reading that a current of milliamps above zero gives
+  uint16_t milliampsToReading(float milliamps);
+
+  // Non-blocking current sampling for the waveform interrupt. Call it every 
+  // tick: it starts a conversion whenever the ADC is free and returns true 
+  // when a new reading is ready in getSample(). Readings taken from loop() 
+  // wait for a conversion started here to finish, so they never mix.
+  bool pollSample();
+  uint16_t getSample() { return sample; }
   
 
   // General config modification
@@ -92,8 +100,14 @@ public:
   void config_setAmpsPerVolt(float ampsPerVolt) { amps_per_volt = ampsPerVolt; }
 
 private:
-  float getMilliamps(uint32_t reading);
-  uint32_t readCurrent() { return analogRead(current_sense_pin); }
+  uint32_t readCurrent();
+
+  // ADC access for pollSample()
+  void startConversion();
+  bool conversionDone();
+  uint16_t conversionResult();
+  static volatile bool adcInUse;        // readCurrent() is using the ADC
+  static Hardware* volatile sampler;    // Owner of the conversion under way
 
   const char *channel_name;
   control_type_t control_scheme;
@@ -119,8 +133,7 @@ private:
   long int lastCheckTime;
   long int lastTripTime;
 
-  // ACK detection base current
-  float baseMilliamps;
+  volatile uint16_t sample;   // Last reading taken by pollSample()
 };
 
 #endif  // COMMANDSTATION_DCC_HARDWARE_H_
\ No newline at end of file
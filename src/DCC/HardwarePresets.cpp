@@ -119,7 +119,9 @@ DCCService* DCCService::Create_Pololu_MC33926Shield_Prog() {
 ////////////////////////////////////////////////////////////////////////////////
 
 #if defined(ARDUINO_ARCH_SAMD)
-// TI DRV8874 on custom board
+// TI DRV8874 on custom board. Railcom comes in on SERCOM4, so the sketch has
+// to pass its interrupt on:
+//   void SERCOM4_Handler() { mainTrack->railcom.rxInterruptHandler(); }
 DCCMain* DCCMain::Create_WSM_FireBox_Main(uint8_t numDevices) {
   Hardware hdw;
   Railcom rcom;
@@ -0,0 +1,286 @@
+/*
+ *  PacketEncoder.h
+ * 
+ *  This file is part of CommandStation.
+ *
+ *  CommandStation is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  CommandStation is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDSTATION_DCC_PACKETENCODER_H_
+#define COMMANDSTATION_DCC_PACKETENCODER_H_
+
+#include <Arduino.h>
+
+#include "Railcom.h"
+#include "Waveform.h"
+
+// Instruction descriptors for multi-function (loco) decoder packets. Each one
+// holds the packet type and number of repeats it is sent with, and the number
+// of bytes it takes up after the address, as compile-time constants. encode()
+// writes those bytes into the packet.
+
+// 128-step speed and direction
+struct SpeedInstruction {
+  static const PacketType type = kThrottleType;
+  static const uint8_t repeats = 0;
+  static const uint8_t length = 2;
+
+  uint8_t speed;
+  uint8_t direction;
+
+  void encode(uint8_t b[]) const {
+    b[0] = 0x3F;   // 128-step speed control byte
+    // max speed is 126, but speed codes range from 2-127
+    // (0=stop, 1=emergency stop)
+    b[1] = speed + (speed > 0) + direction * 128;
+  }
+};
+
+// 128-step emergency stop. Sent to address zero it stops every loco.
+struct EmergencyStopInstruction {
+  static const PacketType type = kThrottleType;
+  static const uint8_t repeats = 1;
+  static const uint8_t length = 2;
+
+  void encode(uint8_t b[]) const {
+    b[0] = 0x3F;   // 128-step speed control byte
+    b[1] = 0x01;   // Emergency stop, direction is ignored
+  }
+};
+
+// Function group one and two (F0-F12)
+struct FunctionGroupInstruction {
+  static const PacketType type = kFunctionType;
+  static const uint8_t repeats = 3;   // Send four times (one plus 3 repeats)
+  static const uint8_t length = 1;
+
+  uint8_t byte1;
+
+  void encode(uint8_t b[]) const {
+    b[0] = (byte1 | 0x80) & 0xBF;
+  }
+};
+
+// Feature expansion function groups (F13-F68)
+struct FunctionExpansionInstruction {
+  static const PacketType type = kFunctionType;
+  static const uint8_t repeats = 3;   // Send four times (one plus 3 repeats)
+  static const uint8_t length = 2;
+
+  uint8_t byte1;
+  uint8_t byte2;
+
+  void encode(uint8_t b[]) const {
+    // 0xD8-0xDC carry F29-F36 up to F61-F68. Otherwise, for safety this 
+    // guarantees that first byte will either be 0xDE (for F13-F20) or 0xDF 
+    // (for F21-F28)
+    if(byte1 >= 0xD8 && byte1 <= 0xDC) b[0] = byte1;
+    else b[0] = (byte1 | 0xDE) & 0xDF;
+    b[1] = byte2;
+  }
+};
+
+// Binary state control, short form (states 1-127, 0 addresses all states)
+struct BinaryStateShortInstruction {
+  static const PacketType type = kFunctionType;
+  static const uint8_t repeats = 3;   // Send four times (one plus 3 repeats)
+  static const uint8_t length = 2;
+
+  uint8_t state;
+  uint8_t value;
+
+  void encode(uint8_t b[]) const {
+    b[0] = 0xDD;
+    b[1] = (value ? 0x80 : 0) | (state & 0x7F);
+  }
+};
+
+// Binary state control, long form (states 128-32767)
+struct BinaryStateLongInstruction {
+  static const PacketType type = kFunctionType;
+  static const uint8_t repeats = 3;   // Send four times (one plus 3 repeats)
+  static const uint8_t length = 3;
+
+  uint16_t state;
+  uint8_t value;
+
+  void encode(uint8_t b[]) const {
+    b[0] = 0xC0;
+    b[1] = (value ? 0x80 : 0) | (state & 0x7F);   // Low seven bits
+    b[2] = (state >> 7) & 0xFF;                   // High eight bits
+  }
+};
+
+// Configuration variable access on the main track. cv is zero based (0-1023),
+// and any CV>1023 will become modulus(1024) due to bit-mask of 0x03. When
+// length is 2 there is no data byte and value is ignored.
+template<uint8_t Opcode, uint8_t Length, PacketType Type, uint8_t Repeats>
+struct POMInstruction {
+  static const PacketType type = Type;
+  static const uint8_t repeats = Repeats;
+  static const uint8_t length = Length;
+
+  uint16_t cv;
+  uint8_t value;
+
+  void encode(uint8_t b[]) const {
+    b[0] = Opcode + (highByte(cv) & 0x03);
+    b[1] = lowByte(cv);
+    if(Length > 2) b[2] = value;
+  }
+};
+
+typedef POMInstruction<0xEC, 3, kPOMByteWriteType, 3> POMWriteByteInstruction;
+// value is the bit manipulation byte, 0xF0 + (bValue * 8) + bNum
+typedef POMInstruction<0xE8, 3, kPOMBitWriteType, 4> POMWriteBitInstruction;
+// The railcom spec leaves an empty data byte on a single byte read
+typedef POMInstruction<0xE4, 3, kPOMReadType, 3> POMReadByteInstruction;
+typedef POMInstruction<0xE0, 2, kPOMLongReadType, 3> POMReadBytesInstruction;
+
+// Extended POM (XPOM) instructions, 1110GGSS followed by a 24-bit zero based
+// CV address. SS is a sequence number (0-3) that the decoder sends back in the
+// railcom ID of its reply, so replies can be matched to requests.
+
+// Reads four consecutive CVs. The reply carries all four bytes.
+struct XPOMReadInstruction {
+  static const PacketType type = kXPOMReadType;
+  static const uint8_t repeats = 3;   // Send four times (one plus 3 repeats)
+  static const uint8_t length = 4;
+
+  uint32_t cv;
+  uint8_t sequence;
+
+  void encode(uint8_t b[]) const {
+    b[0] = 0xE4 | (sequence & 0x03);
+    b[1] = (cv >> 16) & 0xFF;
+    b[2] = (cv >> 8) & 0xFF;
+    b[3] = cv & 0xFF;
+  }
+};
+
+// Writes Count (1-4) consecutive CVs in one packet.
+template<uint8_t Count>
+struct XPOMWriteInstruction {
+  static const PacketType type = kXPOMWriteType;
+  static const uint8_t repeats = 3;   // Send four times (one plus 3 repeats)
+  static const uint8_t length = 4 + Count;
+
+  uint32_t cv;
+  uint8_t sequence;
+  uint8_t values[Count];
+
+  void encode(uint8_t b[]) const {
+    b[0] = 0xEC | (sequence & 0x03);
+    b[1] = (cv >> 16) & 0xFF;
+    b[2] = (cv >> 8) & 0xFF;
+    b[3] = cv & 0xFF;
+    for(uint8_t i = 0; i < Count; i++) b[4 + i] = values[i];
+  }
+};
+
+// Address that DCC-A automatic logon packets are broadcast to
+const uint8_t kLogonAddress = 254;
+
+// Decoder groups a LOGON_ENABLE packet can ask to log on
+enum LogonGroup : uint8_t {
+  kLogonAll = 0,
+  kLogonLocos = 1,
+  kLogonAccessories = 2,
+  kLogonNow = 3     // Every decoder, ignoring any earlier session
+};
+
+class PacketEncoder {
+public:
+  // Long addresses take two bytes, short addresses one.
+  static const uint8_t kMaxAddressLength = 2;
+
+  // CRC8 over a DCC-A packet, polynomial x^8 + x^5 + x^4 + 1
+  static uint8_t crc8(const uint8_t b[], uint8_t n) {
+    uint8_t crc = 0;
+    for(uint8_t i = 0; i < n; i++) {
+      crc ^= b[i];
+      for(uint8_t bit = 0; bit < 8; bit++) 
+        crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1;
+    }
+    return crc;
+  }
+
+  // Builds a LOGON_ENABLE packet, less the checksum. Decoders that haven't 
+  // logged on to this command station (cid) in this session answer it with 
+  // their manufacturer and unique ID. Returns the number of bytes.
+  static uint8_t encodeLogonEnable(LogonGroup group, uint16_t cid, 
+    uint8_t session, uint8_t b[]) {
+    b[0] = kLogonAddress;
+    b[1] = 0xFC | group;
+    b[2] = highByte(cid);
+    b[3] = lowByte(cid);
+    b[4] = session;
+    return 5;
+  }
+
+  // Builds a LOGON_ASSIGN packet, less the checksum, giving the decoder with
+  // a manufacturer and unique ID a long loco address. Returns the number of
+  // bytes.
+  static uint8_t encodeLogonAssign(uint16_t manufacturer, uint32_t uniqueID, 
+    uint16_t addr, uint8_t b[]) {
+    b[0] = kLogonAddress;
+    b[1] = 0xE0 | ((manufacturer >> 8) & 0x0F);
+    b[2] = manufacturer & 0xFF;
+    b[3] = (uniqueID >> 24) & 0xFF;
+    b[4] = (uniqueID >> 16) & 0xFF;
+    b[5] = (uniqueID >> 8) & 0xFF;
+    b[6] = uniqueID & 0xFF;
+    b[7] = 0xC0 | (highByte(addr) & 0x3F);
+    b[8] = lowByte(addr);
+    b[9] = crc8(b, 9);
+    return 10;
+  }
+
+  // Writes a multi-function decoder address to the start of b and returns the
+  // number of bytes written. railcomAddr is set to the address bytes railcom
+  // uses to work out the instruction type.
+  static uint8_t encodeAddress(uint16_t addr, uint8_t b[],
+    uint16_t& railcomAddr) {
+
+    uint8_t nB = 0;
+    railcomAddr = 0;
+
+    if(addr > 127) {
+      b[nB++] = highByte(addr) | 0xC0;    // convert address to packet format
+      railcomAddr = (highByte(addr) | 0xC0) << 8;
+    }
+
+    b[nB++] = lowByte(addr);
+    railcomAddr |= lowByte(addr);
+
+    return nB;
+  }
+
+  // Builds a complete packet, less the checksum, for an instruction to a
+  // multi-function decoder. Returns the number of bytes in the packet.
+  template<class T>
+  static uint8_t encode(uint16_t addr, const T& instruction, uint8_t b[],
+    uint16_t& railcomAddr) {
+
+    // Leave a byte free for the checksum
+    static_assert(kMaxAddressLength + T::length < kPacketMaxSize,
+      "Instruction does not fit in a packet");
+
+    uint8_t nB = encodeAddress(addr, b, railcomAddr);
+    instruction.encode(&b[nB]);
+    return nB + T::length;
+  }
+};
+
+#endif  // COMMANDSTATION_DCC_PACKETENCODER_H_
@@ -45,6 +45,7 @@ public:
   T peek();
   T pop();
   void clear();
+  template<class P> void removeIf(P match);
 };
 
 template<class T, int S>
@@ -65,10 +66,11 @@ inline int Queue<T, S>::back()
   return _back;
 }
 
+// Like pop(), this leaves locking to the caller, so several pushes can share
+// one critical section.
 template<class T, int S>
 void Queue<T, S>::push(const T &item)
 {
-  noInterrupts();
   if(_count < _maxitems) { // Drops out when full
     _data[_back++]=item;
     ++_count;
@@ -76,7 +78,6 @@ void Queue<T, S>::push(const T &item)
     if (_back > _maxitems)
     _back -= (_maxitems + 1);
   }
-  interrupts();
 }
 
 template<class T, int S>
@@ -106,4 +107,25 @@ void Queue<T, S>::clear()
   _count = 0;
 }
 
+// Removes every item for which match(item) is true, keeping the rest in order.
+// Like pop(), this leaves locking to the caller.
+template<class T, int S>
+template<class P>
+void Queue<T, S>::removeIf(P match) 
+{
+  int in = _front;
+  int out = _front;
+  int kept = 0;
+  for (int i = 0; i < _count; i++) {
+    if(!match(_data[in])) {
+      if(out != in) _data[out] = _data[in];
+      kept++;
+      if (++out > _maxitems) out -= (_maxitems + 1);
+    }
+    if (++in > _maxitems) in -= (_maxitems + 1);
+  }
+  _back = out;
+  _count = kept;
+}
+
 #endif  // COMMANDSTATION_DCC_QUEUE_H_
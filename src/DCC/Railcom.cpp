@@ -106,12 +106,15 @@ void Railcom::setupDAC() {
 // TODO(davidcutting42@gmail.com): test on AVR
 void Railcom::enableRecieve(uint8_t on) {
   if(on) {
-    while(serial->available()) {
-      serial->read();   // Flush the buffer so we don't get a bunch of garbage
-    }
   #if defined(ARDUINO_ARCH_SAMD)
+    // Flush the SERCOM so we don't get a bunch of garbage
+    while(sercom->availableDataUART()) sercom->readDataUART();
+    cutoutBytes = 0;
     pinPeripheral(rx_pin, rx_mux);
   #else
+    while(serial->available()) {
+      serial->read();   // Flush the buffer so we don't get a bunch of garbage
+    }
     serial->begin(baud);
   #endif    
   }
@@ -124,154 +127,733 @@ void Railcom::enableRecieve(uint8_t on) {
   }
 }
 
+#if defined(ARDUINO_ARCH_SAMD)
+void Railcom::rxInterruptHandler() {
+  if(sercom->isUARTError()) {
+    sercom->acknowledgeUARTError();
+    sercom->clearStatusUART();
+  }
+  while(sercom->availableDataUART()) {
+    uint8_t b = sercom->readDataUART();
+    if(cutoutBytes < sizeof(cutoutData)) cutoutData[cutoutBytes++] = b;
+  }
+}
+#endif
+
 // This is called from an interrupt routine, so it's gotta be quick. DON'T try
 // to write to the serial port here. You'll destroy the waveform.
-void Railcom::readData(uint16_t _uniqueID, PacketType _packetType, 
+bool Railcom::readData(uint16_t _uniqueID, PacketType _packetType, 
   uint16_t _address) {
 
-  if(dataReady) return;
-  
+#if defined(ARDUINO_ARCH_SAMD)
+  // rxInterruptHandler() has already collected the bytes
+  uint8_t bytes = cutoutBytes;
+#else
   uint8_t bytes = serial->available();
+#endif
+  // Empty cutouts are kept for the link statistics, except after idle 
+  // packets, which nothing answers
+  if(bytes == 0 && _packetType == kIdleType) return false;
+  
+  RailcomCapture capture;
   if(bytes > 8) bytes = 8;
-  serial->readBytes(rawData, bytes);
+#if defined(ARDUINO_ARCH_SAMD)
+  for(uint8_t i = 0; i < bytes; i++) capture.data[i] = cutoutData[i];
+  cutoutBytes = 0;
+#else
+  if(bytes > 0) serial->readBytes(capture.data, bytes);
+#endif
+
+  bool ack = bytes > 2 && 
+    pgm_read_byte_near(&railcom_decode[capture.data[2]]) == ACK;
+
+  if(captures.count() >= kRailcomCaptureSlots) {
+    captureOverflows++;
+    return ack;
+  }
 
-  uniqueID = _uniqueID;
-  address = _address;
-  type = _packetType;
+  capture.count = bytes;
+  capture.transmitID = _uniqueID;
+  capture.address = _address;
+  capture.type = _packetType;
+  capture.timestamp = micros();
   
-  if(bytes > 0)
-    dataReady = true;
+  captures.push(capture);
+  captureCount++;
+
+  return ack;
 }
 
 void Railcom::processData() {
-  if(dataReady) {
-    // CommManager::printf(F("Railcom RAW %d = %x %x %x %x %x %x %x %x\n\r"), 
-    //   uniqueID,
-    //   rawData[0], rawData[1], rawData[2], rawData[3], 
-    //   rawData[4], rawData[5], rawData[6], rawData[7]
-    // );
-
-    for (size_t i = 0; i < 8; i++)
-    {
-      rawData[i] = pgm_read_byte_near(&railcom_decode[rawData[i]]);
-      // Only throw out the packet if channel 2 is corrupted - channel 1 may be 
-      // corrupted by multiple decoders transmitting at once.
-      if(i > 1) {  
-        if(rawData[i] == INV || rawData[i] == RESVD1 || rawData[i] == RESVD2 
-            || rawData[i] == RESVD3) {  
-          dataReady = false;
-          return;
-        }
-      }
+  // Only take the captures that are already there, so a steady stream of 
+  // cutouts can't hold up the loop.
+  noInterrupts();
+  uint8_t waiting = captures.count();
+  interrupts();
+
+  while(waiting--) {
+    noInterrupts();
+    RailcomCapture capture = captures.pop();
+    interrupts();
+
+    processCapture(capture);
+  }
+
+  updatePOM();
+  reportTelemetry();
+
+  if(millis() - lastAgeing > kLocationTimeout / 4) {
+    lastAgeing = millis();
+    ageLocations();
+  }
+}
+
+bool Railcom::POMSlotFree() {
+  for(uint8_t i = 0; i < kPOMTransactions; i++) {
+    if(transactions[i].callback == nullptr) return true;
+  }
+  return false;
+}
+
+int8_t Railcom::openPOM(uint16_t transmitID, uint16_t address, 
+  PacketType type, uint8_t sequence, void (*callback)(RailcomPOMResponse)) {
+  
+  for(uint8_t i = 0; i < kPOMTransactions; i++) {
+    POMTransaction& t = transactions[i];
+    if(t.callback != nullptr) continue;
+
+    t.transmitID = transmitID;
+    t.address = address;
+    t.type = type;
+    t.sequence = sequence;
+    t.state = kPOMWaiting;
+    t.retries = 0;
+    t.lastStatus = kPOMTimeout;
+    t.deadline = millis() + kPOMReplyTimeout;
+    t.callback = callback;
+    return i;
+  }
+  return -1;
+}
+
+int8_t Railcom::nextPOMResend() {
+  for(uint8_t i = 0; i < kPOMTransactions; i++) {
+    if(transactions[i].callback != nullptr && 
+      transactions[i].state == kPOMResend) return i;
+  }
+  return -1;
+}
+
+void Railcom::POMResent(uint8_t index) {
+  POMTransaction& t = transactions[index];
+  t.retries++;
+  t.state = kPOMWaiting;
+  t.deadline = millis() + kPOMReplyTimeout;
+}
+
+Railcom::POMTransaction* Railcom::findPOM(const RailcomCapture& capture) {
+  for(uint8_t i = 0; i < kPOMTransactions; i++) {
+    POMTransaction& t = transactions[i];
+    if(t.callback != nullptr && t.transmitID == capture.transmitID && 
+      t.address == capture.address) return &t;
+  }
+  return nullptr;
+}
+
+void Railcom::completePOM(const RailcomCapture& capture, 
+  RailcomPOMResponse& response) {
+
+  POMTransaction* t = findPOM(capture);
+  if(t == nullptr) return;
+  // A reply to an older XPOM request that happened to share the ID
+  if((t->type == kXPOMReadType || t->type == kXPOMWriteType) && 
+    t->sequence != response.sequence) return;
+
+  void (*callback)(RailcomPOMResponse) = t->callback;
+  t->callback = nullptr;   // Repeats of the packet don't answer twice
+
+  response.status = kPOMSuccess;
+  response.retries = t->retries;
+  callback(response);
+}
+
+void Railcom::replyPOM(const RailcomCapture& capture, uint8_t symbol) {
+  POMTransaction* t = findPOM(capture);
+  if(t == nullptr) return;
+
+  if(symbol == ACK) {
+    // An ACK is all a write gets back from some decoders. A read is still 
+    // waiting for its data.
+    if(!isPOMWrite(t->type)) return;
+
+    RailcomPOMResponse response;
+    response.data = 0;
+    response.transactionID = t->transmitID;
+    response.sequence = t->sequence;
+    completePOM(capture, response);
+    return;
+  }
+
+  // The other repeats of a packet that already failed say the same thing
+  if(t->state != kPOMWaiting) return;
+  failPOM(*t, symbol == BUSY ? kPOMBusy : kPOMNack);
+}
+
+void Railcom::failPOM(POMTransaction& t, RailcomPOMStatus status) {
+  if(status != kPOMTimeout) t.lastStatus = status;
+  if(t.retries < kPOMMaxRetries) {
+    t.state = kPOMBackoff;
+    t.deadline = millis() + ((uint32_t)kPOMRetryBackoff << t.retries);
+    return;
+  }
+
+  void (*callback)(RailcomPOMResponse) = t.callback;
+  t.callback = nullptr;
+
+  RailcomPOMResponse response;
+  response.data = 0;
+  response.transactionID = t.transmitID;
+  response.sequence = t.sequence;
+  // A decoder that said BUSY or NACK and then went quiet is reported by what
+  // it last said, not as a timeout
+  response.status = t.lastStatus;
+  response.retries = t.retries;
+  callback(response);
+}
+
+void Railcom::updatePOM() {
+  uint32_t now = millis();
+  for(uint8_t i = 0; i < kPOMTransactions; i++) {
+    POMTransaction& t = transactions[i];
+    if(t.callback == nullptr || (int32_t)(now - t.deadline) < 0) continue;
+
+    if(t.state == kPOMWaiting) failPOM(t, kPOMTimeout);
+    else if(t.state == kPOMBackoff) t.state = kPOMResend;
+  }
+}
+
+void Railcom::decode(const uint8_t raw[], uint8_t count, 
+  RailcomSymbols& out) {
+
+  // Every special value in the decode table has bit 7 set and data never 
+  // does. The low three bits of the specials are 7 (INV), 6 (ACK), 5 (NACK), 
+  // 4 (BUSY), 3, 2 and 0 (reserved), so bits 4-6 of kReplyFlags pick out the
+  // replies.
+  const uint8_t kReplyFlags = 0x70;
+
+  out.received = (uint8_t)((1U << count) - 1);
+  out.data = 0;
+  out.reply = 0;
+
+  for(uint8_t i = 0; i < 8; i++) {
+    uint8_t v = pgm_read_byte_near(&railcom_decode[raw[i]]);
+    uint8_t special = v >> 7;
+    // Bytes that never arrived decode as zero
+    out.symbols[i] = v & -((out.received >> i) & 1);
+    out.data |= (special ^ 1) << i;
+    out.reply |= (special & (kReplyFlags >> (v & 0x07))) << i;
+  }
+
+  out.data &= out.received;
+  out.reply &= out.received;
+}
+
+bool Railcom::processLogon(const RailcomCapture& capture, 
+  const RailcomSymbols& decoded) {
+
+  const uint8_t* sym = decoded.symbols;
+
+  if(capture.type == kLogonEnableType) {
+    // The reply fills both channels. Anything less than eight clean symbols 
+    // means decoders talked over each other, and they back off and try again
+    // at random.
+    if(decoded.data != 0xFF || ((sym[0] >> 2) & 0x0F) != kMOB_LOGON) {
+      if(decoded.received != 0) logonCollisions++;
+      return true;
     }
-    
-    // Verbose print of decoded railcom data to CommManager
-    // CommManager::printf(F("Railcom DCD %d = %x %x %x %x %x %x %x %x\n\r"), 
-    //   uniqueID,
-    //   rawData[0], rawData[1], rawData[2], rawData[3], 
-    //   rawData[4], rawData[5], rawData[6], rawData[7]
-    // );
-    
-    RailcomDatagram datagrams[4]; // One in ch1 plus up to three in ch2
-
-    // First datagram is always the same format
-    datagrams[0].channel = 1;
-    datagrams[0].identifier = (rawData[0] >> 2) & 0x0F;
-    datagrams[0].payload = (rawData[0] & 0x03) << 6 | (rawData[1] & 0x3F);
-
-    switch (datagrams[0].identifier)
-    {
-    case kMOB_ADR_HIGH:
-      // CommManager::printf(F("ADR HIGH %d (%d)\n\r"), datagrams[0].payload, 
-      //   address);
+    if(logonReplyWaiting) return true;  // DCCMain will hear it again
+
+    logonManufacturer = ((uint16_t)(sym[0] & 0x03) << 10) | 
+      ((uint16_t)sym[1] << 4) | (sym[2] >> 2);
+    logonUniqueID = ((uint32_t)(sym[2] & 0x03) << 30) | 
+      ((uint32_t)sym[3] << 24) | ((uint32_t)sym[4] << 18) | 
+      ((uint32_t)sym[5] << 12) | ((uint32_t)sym[6] << 6) | sym[7];
+    logonReplyWaiting = true;
+    return true;
+  }
+
+  if(capture.type == kLogonAssignType) {
+    // Any clean answer in channel 2 confirms the decoder took the address
+    if((decoded.data | decoded.reply) & 0x04) 
+      logonAssigned = capture.transmitID;
+    return true;
+  }
+
+  return false;
+}
+
+bool Railcom::takeLogonReply(uint16_t& manufacturer, uint32_t& uniqueID) {
+  if(!logonReplyWaiting) return false;
+  manufacturer = logonManufacturer;
+  uniqueID = logonUniqueID;
+  logonReplyWaiting = false;
+  return true;
+}
+
+uint16_t Railcom::takeLogonAssigned() {
+  uint16_t id = logonAssigned;
+  logonAssigned = 0;
+  return id;
+}
+
+uint16_t Railcom::locoAddress(uint16_t railcomAddr) {
+  if(highByte(railcomAddr) >= 192) 
+    return ((highByte(railcomAddr) & 0x3F) << 8) | lowByte(railcomAddr);
+  return lowByte(railcomAddr);
+}
+
+RailcomTelemetry* Railcom::findTelemetry(uint16_t addr, bool create) {
+  if(addr == 0) return nullptr;
+
+  RailcomTelemetry* oldest = &telemetry[0];
+  for(uint8_t i = 0; i < kTelemetrySlots; i++) {
+    RailcomTelemetry& t = telemetry[i];
+    if(t.address == addr) return &t;
+    // Prefer a free slot, then the loco heard from longest ago that nobody 
+    // has subscribed to
+    if(oldest->address == 0) continue;
+    if(t.address == 0 || (t.mode == kTelemetryOff && 
+      (oldest->mode != kTelemetryOff || t.lastSeen < oldest->lastSeen))) 
+      oldest = &t;
+  }
+  if(!create || (oldest->address != 0 && oldest->mode != kTelemetryOff)) 
+    return nullptr;
+
+  memset(oldest, 0, sizeof(RailcomTelemetry));
+  oldest->address = addr;
+  return oldest;
+}
+
+bool Railcom::subscribeTelemetry(uint16_t addr, RailcomTelemetryMode mode, 
+  uint16_t period) {
+  
+  RailcomTelemetry* t = findTelemetry(addr, mode != kTelemetryOff);
+  if(t == nullptr) return mode == kTelemetryOff;
+
+  t->mode = mode;
+  t->period = period;
+  t->lastReport = millis();
+  return true;
+}
+
+const RailcomTelemetry* Railcom::getTelemetry(uint16_t addr) {
+  const RailcomTelemetry* t = findTelemetry(addr, false);
+  if(t == nullptr || t->lastSeen == 0) return nullptr;
+  return t;
+}
+
+void Railcom::processDynamic(uint16_t addr, const RailcomSymbols& decoded, 
+  uint8_t start) {
+
+  RailcomTelemetry* t = nullptr;
+
+  // Channel 2 has room for two DYN datagrams of three symbols each
+  for(uint8_t i = start; i + 2 < 8; i += 3) {
+    if(((decoded.data >> i) & 0x07) != 0x07) break;
+    if(((decoded.symbols[i] >> 2) & 0x0F) != kMOB_DYN) break;
+
+    uint8_t value = ((decoded.symbols[i] & 0x03) << 6) | 
+      (decoded.symbols[i + 1] & 0x3F);
+    uint8_t dv = decoded.symbols[i + 2] & 0x3F;
+
+    if(t == nullptr) t = findTelemetry(addr, true);
+    if(t == nullptr) return;
+    t->lastSeen = millis();
+
+    uint8_t changed = 0;
+    switch(dv) {
+    case kDV_SPEED:
+    case kDV_SPEED_HIGH: {
+      uint16_t speed = value + (dv == kDV_SPEED_HIGH ? 256 : 0);
+      if(speed != t->speed) changed = kTelemetrySpeed;
+      t->speed = speed;
+      break;
+      }
+    case kDV_QOS:
+      if(value != t->qos) changed = kTelemetryQoS;
+      t->qos = value;
       break;
-    case kMOB_ADR_LOW:
-      // CommManager::printf(F("ADR LOW %d (%d)\n\r"), datagrams[0].payload, 
-      //   address);
+    case kDV_FUEL:
+      if(value != t->fuel) changed = kTelemetryFuel;
+      t->fuel = value;
+      break;
+    case kDV_WATER:
+      if(value != t->water) changed = kTelemetryWater;
+      t->water = value;
+      break;
+    case kDV_TEMPERATURE:
+      if(value - 50 != t->temperature) changed = kTelemetryTemperature;
+      t->temperature = value - 50;
       break;
     }
+    t->changed |= changed;
+  }
+}
+
+void Railcom::reportTelemetry() {
+  if(telemetryReport == nullptr) return;
+
+  uint32_t now = millis();
+  for(uint8_t i = 0; i < kTelemetrySlots; i++) {
+    RailcomTelemetry& t = telemetry[i];
+    if(t.address == 0) continue;
+
+    bool due = false;
+    if(t.mode == kTelemetryOnChange) due = t.changed != 0;
+    else if(t.mode == kTelemetryPeriodic) due = now - t.lastReport >= t.period;
+    if(!due) continue;
+
+    telemetryReport(t);
+    t.changed = 0;
+    t.lastReport = now;
+  }
+}
+
+int8_t Railcom::findLocation(uint16_t addr) {
+  if(addr == 0) return -1;
 
-    // CommManager::printf(F("%d,%d\n\r"), highByte(address), lowByte(address));
+  uint8_t i = locationHash(addr);
+  for(uint8_t n = 0; n < kLocationTableSize; n++) {
+    if(locationTable[i].address == addr) return i;
+    if(locationTable[i].address == 0) return -1;
+    i = (i + 1) & (kLocationTableSize - 1);
+  }
+  return -1;
+}
 
-    // For now, return if there's a special bit combination in the first byte of
-    // channel two.
-    if(rawData[2] == ACK || rawData[2] == NACK || rawData[2] == BUSY) {
-      dataReady = false;
+void Railcom::seeLocation(uint16_t addr) {
+  uint8_t i = locationHash(addr);
+  for(uint8_t n = 0; n < kLocationTableSize; n++) {
+    if(locationTable[i].address == addr) {
+      locationTable[i].lastSeen = millis();
       return;
     }
-
-    RailcomInstructionType instructionType;
-    if(highByte(address) >= 1 && highByte(address) <= 127) {
-      instructionType = kMOBInstruction;
+    if(locationTable[i].address == 0) {
+      locationTable[i].address = addr;
+      locationTable[i].lastSeen = millis();
+      if(locationChange != nullptr) locationChange(addr, true);
+      return;
     }
-    else if(highByte(address) >= 128 && highByte(address) <= 191) {
-      instructionType = kSTATInstruction;
+    i = (i + 1) & (kLocationTableSize - 1);
+  }
+  // Table is full, the loco will be picked up once another one ages out
+}
+
+void Railcom::ageLocations() {
+  uint32_t now = millis();
+  for(uint8_t i = 0; i < kLocationTableSize; i++) {
+    if(locationTable[i].address == 0 || 
+      now - locationTable[i].lastSeen < kLocationTimeout) continue;
+
+    uint16_t gone = locationTable[i].address;
+    locationTable[i].address = 0;
+
+    // Shift later entries in the probe chain back into the hole so lookups 
+    // don't stop short at it
+    uint8_t hole = i;
+    uint8_t j = (i + 1) & (kLocationTableSize - 1);
+    while(locationTable[j].address != 0) {
+      uint8_t home = locationHash(locationTable[j].address);
+      // Move the entry if its home slot isn't between the hole and j
+      if(((j - home) & (kLocationTableSize - 1)) >= 
+        ((j - hole) & (kLocationTableSize - 1))) {
+        locationTable[hole] = locationTable[j];
+        locationTable[j].address = 0;
+        hole = j;
+      }
+      j = (j + 1) & (kLocationTableSize - 1);
     }
-    else if(highByte(address) >= 192 && highByte(address) <= 231) {
-      instructionType = kMOBInstruction;
+
+    if(locationChange != nullptr) locationChange(gone, false);
+    // An entry may have moved into this slot, so look at it again
+    if(locationTable[i].address != 0) i--;
+  }
+}
+
+uint8_t Railcom::getLocations(uint16_t addrs[], uint8_t max) {
+  uint8_t n = 0;
+  for(uint8_t i = 0; i < kLocationTableSize && n < max; i++) {
+    if(locationTable[i].address != 0) addrs[n++] = locationTable[i].address;
+  }
+  return n;
+}
+
+void Railcom::processAddress(uint8_t identifier, uint8_t payload, 
+  uint32_t timestamp) {
+  
+  if(identifier == kMOB_ADR_HIGH) {
+    adrHigh = payload;
+    adrHighValid = true;
+    adrHighTime = timestamp;
+    return;
+  }
+
+  // Decoders send the two halves in alternate cutouts, so a high half older 
+  // than a couple of packets belongs to something else.
+  if(!adrHighValid || timestamp - adrHighTime > 50000UL) return;
+  adrHighValid = false;
+
+  uint16_t addr;
+  if(adrHigh == 0) addr = payload & 0x7F;     // Short address
+  else if((adrHigh & 0xC0) == 0x80) 
+    addr = ((adrHigh & 0x3F) << 8) | payload; // Long address
+  else return;    // Consist and other addresses aren't tracked
+
+  if(addr != 0) seeLocation(addr);
+}
+
+void Railcom::addLinkStats(RailcomLinkStats& stats, 
+  const RailcomSymbols& decoded) {
+
+  if(stats.captures >= kLinkStatsWindow) {
+    stats.captures /= 2;
+    stats.empty /= 2;
+    stats.channel1 /= 2;
+    stats.channel2 /= 2;
+    stats.invalid /= 2;
+    stats.acks /= 2;
+    stats.nacks /= 2;
+    stats.busys /= 2;
+  }
+
+  stats.captures++;
+  stats.lastSeen = millis();
+  if(decoded.received == 0) {
+    stats.empty++;
+    return;
+  }
+
+  uint8_t channel2 = decoded.received & 0xFC;
+  uint8_t bad = decoded.received & ~(decoded.data | decoded.reply);
+  for(; bad; bad &= bad - 1) stats.invalid++;
+
+  if((decoded.data & 0x03) == 0x03) stats.channel1++;
+  if(channel2 != 0 && (decoded.data & channel2) == channel2) stats.channel2++;
+  if(decoded.reply & 0x04) {
+    switch(decoded.symbols[2]) {
+    case ACK: stats.acks++; break;
+    case NACK: stats.nacks++; break;
+    case BUSY: stats.busys++; break;
     }
-    else {
-      instructionType = kNoInstruction;
+  }
+}
+
+void Railcom::recordLinkStats(const RailcomCapture& capture, 
+  const RailcomSymbols& decoded) {
+
+  addLinkStats(districtStats, decoded);
+
+  // Only multi-function decoder packets have a loco to charge it to
+  uint8_t high = highByte(capture.address);
+  uint8_t low = lowByte(capture.address);
+  if(!((high == 0 && low >= 1 && low <= 127) || (high >= 192 && high <= 231)))
+    return;
+  uint16_t addr = locoAddress(capture.address);
+
+  RailcomLinkStats* slot = &linkStats[0];
+  for(uint8_t i = 0; i < kLinkStatsSlots; i++) {
+    if(linkStats[i].address == addr) {
+      slot = &linkStats[i];
+      break;
     }
+    // Otherwise take over the slot that has gone longest without a capture
+    if(slot->address != 0 && (linkStats[i].address == 0 || 
+      linkStats[i].lastSeen < slot->lastSeen)) slot = &linkStats[i];
+  }
+  if(slot->address != addr) {
+    memset(slot, 0, sizeof(RailcomLinkStats));
+    slot->address = addr;
+  }
+
+  addLinkStats(*slot, decoded);
+}
+
+const RailcomLinkStats* Railcom::getLinkStats(uint16_t addr) {
+  for(uint8_t i = 0; i < kLinkStatsSlots; i++) {
+    if(addr != 0 && linkStats[i].address == addr) return &linkStats[i];
+  }
+  return nullptr;
+}
+
+void Railcom::processCapture(RailcomCapture& capture) {
+  uint16_t uniqueID = capture.transmitID;
+  uint16_t address = capture.address;
+  PacketType type = capture.type;
+
+  // CommManager::printf(F("Railcom RAW %d = %x %x %x %x %x %x %x %x\n\r"), 
+  //   uniqueID,
+  //   capture.data[0], capture.data[1], capture.data[2], capture.data[3], 
+  //   capture.data[4], capture.data[5], capture.data[6], capture.data[7]
+  // );
+
+  RailcomSymbols decoded;
+  decode(capture.data, capture.count, decoded);
+  uint8_t* rawData = decoded.symbols;
+
+  uint8_t channel2 = decoded.received & 0xFC;
+  bool channel2Valid = ((decoded.data | decoded.reply) & channel2) == channel2;
+
+  decodeStats.captures++;
+  if(channel2 == 0) decodeStats.empty++;
+  else if(!channel2Valid) decodeStats.invalid++;
+  else if(decoded.reply & 0x04) decodeStats.replies++;
+  else decodeStats.datagrams++;
+
+  recordLinkStats(capture, decoded);
+
+  if(processLogon(capture, decoded)) return;
+
+  // Only throw out the packet if channel 2 is corrupted - channel 1 may be 
+  // corrupted by multiple decoders transmitting at once.
+  if(!channel2Valid) return;
+  
+  // Verbose print of decoded railcom data to CommManager
+  // CommManager::printf(F("Railcom DCD %d = %x %x %x %x %x %x %x %x\n\r"), 
+  //   uniqueID,
+  //   rawData[0], rawData[1], rawData[2], rawData[3], 
+  //   rawData[4], rawData[5], rawData[6], rawData[7]
+  // );
+  
+  RailcomDatagram datagrams[4]; // One in ch1 plus up to three in ch2
+
+  // First datagram is always the same format
+  datagrams[0].channel = 1;
+  datagrams[0].identifier = (rawData[0] >> 2) & 0x0F;
+  datagrams[0].payload = (rawData[0] & 0x03) << 6 | (rawData[1] & 0x3F);
+
+  switch (datagrams[0].identifier)
+  {
+  case kMOB_ADR_HIGH:
+  case kMOB_ADR_LOW:
+    // Channel 1 is only worth reading if both bytes came in clean
+    if((decoded.data & 0x03) == 0x03)
+      processAddress(datagrams[0].identifier, datagrams[0].payload, 
+        capture.timestamp);
+    break;
+  }
+
+  // CommManager::printf(F("%d,%d\n\r"), highByte(address), lowByte(address));
+
+  // Nothing came in on channel 2
+  if(channel2 == 0) return;
+
+  // ACK, NACK or BUSY in the first byte of channel two answers a POM request
+  if(decoded.reply & 0x04) {
+    replyPOM(capture, rawData[2]);
+    return;
+  }
+
+  RailcomInstructionType instructionType;
+  // Short addresses only take up the low byte
+  if(highByte(address) == 0 && lowByte(address) >= 1 && 
+    lowByte(address) <= 127) {
+    instructionType = kMOBInstruction;
+  }
+  else if(highByte(address) >= 1 && highByte(address) <= 127) {
+    instructionType = kMOBInstruction;
+  }
+  else if(highByte(address) >= 128 && highByte(address) <= 191) {
+    instructionType = kSTATInstruction;
+  }
+  else if(highByte(address) >= 192 && highByte(address) <= 231) {
+    instructionType = kMOBInstruction;
+  }
+  else {
+    instructionType = kNoInstruction;
+  }
+
+
+  datagrams[1].channel = 2;
+  datagrams[1].identifier = (rawData[2] >> 2) & 0x0F;
+
+  if(instructionType == kMOBInstruction) {
+    switch(datagrams[1].identifier) {
+    case kMOB_XPOM0:
+    case kMOB_XPOM1:
+    case kMOB_XPOM2:
+    case kMOB_XPOM3: {
+      // XPOM replies always carry four bytes
+      if(type != kXPOMReadType && type != kXPOMWriteType) {
+        return;
+      }
+      datagrams[1].payload = 
+        ((uint32_t)(rawData[2] & 0x03) << 30) | 
+        ((uint32_t)(rawData[3] & 0x3F) << 24) |
+        ((uint32_t)(rawData[4] & 0x3F) << 18) |
+        ((uint32_t)(rawData[5] & 0x3F) << 12) |
+        ((uint32_t)(rawData[6] & 0x3F) << 6) |
+        (rawData[7] & 0x3F);
 
+      RailcomPOMResponse response;
 
-    datagrams[1].channel = 2;
-    datagrams[1].identifier = (rawData[2] >> 2) & 0x0F;
-
-    if(instructionType == kMOBInstruction) {
-      switch(datagrams[1].identifier) {
-      case kMOB_POM: {
-        switch(type) {  // Decode based on what packet was just sent
-        case kPOMBitWriteType:
-        case kPOMByteWriteType:
-        case kPOMReadType:
-          datagrams[1].payload = 
-            ((rawData[2] & 0x03) << 6) | 
-            (rawData[3] & 0x3F);
-          break;
-        case kPOMLongReadType:
-          datagrams[1].payload = 
-            ((rawData[2] & 0x03) << 30) | 
-            ((rawData[3] & 0x3F) << 24) |
-            ((rawData[4] & 0x3F) << 18) |
-            ((rawData[5] & 0x3F) << 12) |
-            ((rawData[6] & 0x3F) << 6) |
-            (rawData[7] & 0x3F);
-          break;
-        default:
-          dataReady = false;
-          return;
-        }
-        
-        RailcomPOMResponse response;
-
-        response.data = datagrams[1].payload;
-        response.transactionID = uniqueID;
-
-        POMResponse(response);
-        
+      response.data = datagrams[1].payload;
+      response.transactionID = uniqueID;
+      response.sequence = datagrams[1].identifier - kMOB_XPOM0;
+
+      completePOM(capture, response);
+
+      break;
+      }
+    case kMOB_POM: {
+      switch(type) {  // Decode based on what packet was just sent
+      case kPOMBitWriteType:
+      case kPOMByteWriteType:
+      case kPOMReadType:
+        datagrams[1].payload = 
+          ((rawData[2] & 0x03) << 6) | 
+          (rawData[3] & 0x3F);
         break;
-        }
-      case kMOB_EXT:
-      case kMOB_DYN:
-      case kMOB_SUBID:
-        break;  // We will handle these cases in a later revision
+      case kPOMLongReadType:
+        datagrams[1].payload = 
+          ((rawData[2] & 0x03) << 30) | 
+          ((rawData[3] & 0x3F) << 24) |
+          ((rawData[4] & 0x3F) << 18) |
+          ((rawData[5] & 0x3F) << 12) |
+          ((rawData[6] & 0x3F) << 6) |
+          (rawData[7] & 0x3F);
+        break;
+      default:
+        return;
       }
-    } 
-    else if(instructionType == kSTATInstruction) {
-      switch(datagrams[1].identifier) {
-      case kSTAT_POM:
-      case kSTAT_STAT1:
-      case kSTAT_TIME:
-      case kSTAT_ERROR:
-      case kSTAT_DYN:
-      case kSTAT_STAT2:
-      case kSTAT_SUBID:
-        break;  // We will handle these cases in a later revision
+      
+      RailcomPOMResponse response;
+
+      response.data = datagrams[1].payload;
+      response.transactionID = uniqueID;
+      response.sequence = 0;
+
+      completePOM(capture, response);
+      
+      break;
       }
-    }   
-    
-    dataReady = false;
-    return;
-  }
+    case kMOB_DYN:
+      processDynamic(locoAddress(address), decoded, 2);
+      break;
+    case kMOB_EXT:
+    case kMOB_SUBID:
+      break;  // We will handle these cases in a later revision
+    }
+  } 
+  else if(instructionType == kSTATInstruction) {
+    switch(datagrams[1].identifier) {
+    case kSTAT_POM:
+    case kSTAT_STAT1:
+    case kSTAT_TIME:
+    case kSTAT_ERROR:
+    case kSTAT_DYN:
+    case kSTAT_STAT2:
+    case kSTAT_SUBID:
+      break;  // We will handle these cases in a later revision
+    }
+  }   
 }
\ No newline at end of file
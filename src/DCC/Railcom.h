@@ -58,7 +58,13 @@ enum RailcomMOBID : uint8_t {
   kMOB_ADR_LOW = 2,
   kMOB_EXT = 3,
   kMOB_DYN = 7,
-  kMOB_SUBID = 12
+  kMOB_XPOM0 = 8,   // XPOM replies, ID is 8 plus the sequence number
+  kMOB_XPOM1 = 9,
+  kMOB_XPOM2 = 10,
+  kMOB_XPOM3 = 11,
+  kMOB_SUBID = 12,
+  kMOB_DECODER_STATE = 13,
+  kMOB_LOGON = 15     // Logon reply, takes up both channels
 };
 
 enum RailcomSTATID : uint8_t {
@@ -77,10 +83,15 @@ enum PacketType : uint8_t {
   kThrottleType,
   kFunctionType,
   kAccessoryType,
+  kExtAccessoryType,
   kPOMByteWriteType,  // Railcom is same as standard command for write byte
   kPOMBitWriteType,   // Railcom is same as standard command for write bit
   kPOMReadType,
   kPOMLongReadType,
+  kXPOMReadType,
+  kXPOMWriteType,
+  kLogonEnableType,
+  kLogonAssignType,
   kSrvcByteWriteType,
   kSrvcBitWriteType,
   kSrvcReadType
@@ -92,11 +103,136 @@ struct RailcomDatagram {
   uint32_t payload; // LSB justified payload of the datagram, excluding the ID
 };
 
+// Raw bytes read from one cutout, with the packet that was sent before it
+struct RailcomCapture {
+  uint8_t data[8];
+  uint8_t count;          // Number of bytes received
+  uint16_t transmitID;
+  PacketType type;
+  uint16_t address;
+  uint32_t timestamp;     // micros() at the end of the cutout
+};
+
+// A capture run through the 4/8 decode table. Bit n of each mask describes 
+// symbols[n].
+struct RailcomSymbols {
+  uint8_t symbols[8];   // Decoded values, 0x00-0x3F for data
+  uint8_t received;     // Byte came in during the cutout
+  uint8_t data;         // Received and decoded to six bits of data
+  uint8_t reply;        // Received and decoded to ACK, NACK or BUSY
+};
+
+// Counts of how captures decoded, by what was in channel 2
+struct RailcomDecodeStats {
+  uint32_t captures;
+  uint32_t empty;       // Nothing came in
+  uint32_t invalid;     // A symbol wasn't a valid 4/8 code
+  uint32_t replies;     // Started with ACK, NACK or BUSY
+  uint32_t datagrams;   // Decoded to datagrams
+};
+
+// Rolling link quality counters for one loco or a whole district. Every 
+// counter is halved once captures reaches kLinkStatsWindow, so old cutouts 
+// count for less and less.
+struct RailcomLinkStats {
+  uint16_t address;     // Loco address, zero for a free slot or a district
+  uint16_t captures;    // Cutouts after a packet
+  uint16_t empty;       // Cutouts with nothing in either channel
+  uint16_t channel1;    // Clean channel 1 datagrams
+  uint16_t channel2;    // Clean channel 2 datagrams
+  uint16_t invalid;     // Symbols that weren't valid 4/8 codes
+  uint16_t acks;
+  uint16_t nacks;
+  uint16_t busys;
+  uint32_t lastSeen;    // millis() of the last capture
+};
+
+// Number of locos link quality is kept for
+const uint8_t kLinkStatsSlots = 8;
+const uint16_t kLinkStatsWindow = 1024;
+
+// Number of cutouts that can be captured before processData() gets to them
+const uint8_t kRailcomCaptureSlots = 8;
+
+// Number of loco addresses the location table can hold, a power of two
+const uint8_t kLocationTableSize = 16;
+// Milliseconds without a loco's channel 1 address before it is taken off the
+// location table
+const uint16_t kLocationTimeout = 2000;
+
+// Dynamic variables (DV) decoders send in DYN datagrams
+enum RailcomDynamicVariable : uint8_t {
+  kDV_SPEED = 0,          // Real speed 0-255 km/h
+  kDV_SPEED_HIGH = 1,     // Real speed 256-511 km/h, less 256
+  kDV_QOS = 7,            // Percentage of packets received with errors
+  kDV_FUEL = 8,           // Container 1, percent full
+  kDV_WATER = 9,          // Container 2, percent full
+  kDV_TEMPERATURE = 26    // Degrees C, plus 50
+};
+
+// Number of locos telemetry is kept for. The least recently heard from loco
+// makes room for a new one.
+const uint8_t kTelemetrySlots = 8;
+
+enum RailcomTelemetryMode : uint8_t {
+  kTelemetryOff,        // Don't report
+  kTelemetryOnChange,   // Report whenever a value changes
+  kTelemetryPeriodic    // Report every period milliseconds
+};
+
+// Bits in RailcomTelemetry::changed
+const uint8_t kTelemetrySpeed = 0x01;
+const uint8_t kTelemetryQoS = 0x02;
+const uint8_t kTelemetryFuel = 0x04;
+const uint8_t kTelemetryWater = 0x08;
+const uint8_t kTelemetryTemperature = 0x10;
+
+// Last values a loco sent in DYN datagrams, and how a client wants them 
+// reported. An address of zero marks a free slot.
+struct RailcomTelemetry {
+  uint16_t address;
+  uint16_t speed;         // km/h
+  uint8_t qos;            // Percent
+  uint8_t fuel;           // Percent
+  uint8_t water;          // Percent
+  int16_t temperature;    // Degrees C
+  uint8_t changed;        // Values that changed since the last report
+  uint32_t lastSeen;      // millis() of the last DYN datagram
+  RailcomTelemetryMode mode;
+  uint16_t period;        // Milliseconds between periodic reports
+  uint32_t lastReport;    // millis() of the last report
+};
+
+// Number of POM requests that can be waiting for a reply at once
+const uint8_t kPOMTransactions = 8;
+// Milliseconds a POM request waits for its reply, from when it is queued
+const uint16_t kPOMReplyTimeout = 1000;
+// Times a POM request is sent again after BUSY, NACK or no reply, and the
+// wait before the first retry in milliseconds. The wait doubles each time.
+const uint8_t kPOMMaxRetries = 3;
+const uint16_t kPOMRetryBackoff = 50;
+
+enum RailcomPOMStatus : uint8_t {
+  kPOMSuccess,
+  kPOMTimeout,    // No reply came before the deadline
+  kPOMNack,       // The decoder rejected the packet
+  kPOMBusy        // The decoder was still busy with an earlier write
+};
+
 struct RailcomPOMResponse {
   uint32_t data;
   uint16_t transactionID;
+  uint8_t sequence;   // XPOM sequence number the decoder replied with
+  RailcomPOMStatus status;
+  uint8_t retries;    // Number of times the request was sent again
 };
 
+// Returns true for the POM packet types that change a CV
+inline bool isPOMWrite(PacketType type) {
+  return type == kPOMByteWriteType || type == kPOMBitWriteType || 
+    type == kXPOMWriteType;
+}
+
 class Railcom
 {
 public:
@@ -106,14 +242,71 @@ public:
   void setup();
 
   void enableRecieve(uint8_t on);
-  void readData(uint16_t dataID, PacketType _packetType, uint16_t _address);
+  // Captures the bytes from a cutout. Called from the waveform interrupt. 
+  // Returns true if channel 2 started with an ACK.
+  bool readData(uint16_t dataID, PacketType _packetType, uint16_t _address);
+  // Decodes every capture waiting in the ring.
   void processData();
+  const RailcomDecodeStats& getDecodeStats() { return decodeStats; }
+  // Link quality for the whole district this railcom detector covers, and 
+  // for a loco (nullptr if it hasn't had a packet with a cutout lately).
+  const RailcomLinkStats& getDistrictStats() { return districtStats; }
+  const RailcomLinkStats* getLinkStats(uint16_t addr);
+  // Decodes count raw bytes and works out which of them are valid, without 
+  // branching on the byte values.
+  static void decode(const uint8_t raw[], uint8_t count, RailcomSymbols& out);
+
+  // Number of cutouts captured, and the number dropped because the ring was 
+  // full, since startup.
+  uint16_t getCaptureCount() { return captureCount; }
+  uint16_t getCaptureOverflows() { return captureOverflows; }
+
+  // Returns true if there is room in the transaction table for another POM 
+  // request.
+  bool POMSlotFree();
+  // Waits for the reply to a POM packet, matched by its transmit ID and 
+  // railcom address. A BUSY, NACK or missing reply asks for the packet to be
+  // sent again, up to kPOMMaxRetries times, before the callback gets the 
+  // failure. Returns the transaction's index, or -1 if the table is full.
+  int8_t openPOM(uint16_t transmitID, uint16_t address, PacketType type, 
+    uint8_t sequence, void (*callback)(RailcomPOMResponse));
+  // Returns the index of a transaction whose packet is due to be sent again,
+  // or -1. The caller sends it and then calls POMResent().
+  int8_t nextPOMResend();
+  void POMResent(uint8_t index);
+
+  // Sets how a loco's telemetry is reported. Returns false if there is no 
+  // room to keep telemetry for another loco.
+  bool subscribeTelemetry(uint16_t addr, RailcomTelemetryMode mode, 
+    uint16_t period);
+  // Returns the telemetry for a loco, or nullptr if it has sent none
+  const RailcomTelemetry* getTelemetry(uint16_t addr);
+
+  // Returns true, with the manufacturer and unique ID of a decoder that 
+  // answered a LOGON_ENABLE packet, if there is one waiting.
+  bool takeLogonReply(uint16_t& manufacturer, uint32_t& uniqueID);
+  // Returns the transmit ID of a LOGON_ASSIGN packet a decoder answered, or
+  // zero if there isn't one waiting.
+  uint16_t takeLogonAssigned();
+  // Number of LOGON_ENABLE cutouts that came in garbled because several 
+  // decoders answered at once.
+  uint16_t getLogonCollisions() { return logonCollisions; }
+
+  // Returns true if a loco has sent its address in channel 1 recently.
+  bool isPresent(uint16_t addr) { return findLocation(addr) >= 0; }
+  // Copies up to max addresses from the location table into addrs and 
+  // returns how many there were.
+  uint8_t getLocations(uint16_t addrs[], uint8_t max);
 
   // Railcom config modification
   void config_setEnable(uint8_t isRailcom) { enable = isRailcom; }
   void config_setRxPin(uint8_t pin) { rx_pin = pin; }
   void config_setTxPin(uint8_t pin) { tx_pin = pin; }
 #if defined(ARDUINO_ARCH_SAMD) 
+  // Moves received bytes straight from the SERCOM into the cutout buffer. The
+  // sketch must call this from the handler of the railcom SERCOM, e.g.
+  // void SERCOM4_Handler() { mainTrack->railcom.rxInterruptHandler(); }
+  void rxInterruptHandler();
   Uart* getSerial() { return serial; }
   void config_setSerial(Uart* serial) { this->serial = serial; }
   void config_setSercom(SERCOM* sercom) { this->sercom = sercom; }
@@ -125,17 +318,118 @@ public:
   HardwareSerial* getSerial() { return serial; }
   void config_setSerial(HardwareSerial* serial) { this->serial = serial; }
 #endif
-  void config_setPOMResponseCallback(void (*_POMResponse)(RailcomPOMResponse)) {
-    POMResponse = _POMResponse;
+  // Called with a loco's telemetry each time it is due to be reported
+  void config_setTelemetryCallback(
+    void (*_telemetryReport)(const RailcomTelemetry&)) {
+    telemetryReport = _telemetryReport;
+  }
+  // Called with present true when a loco first shows up in channel 1, and 
+  // with present false when it ages out of the location table.
+  void config_setLocationCallback(void (*_locationChange)(uint16_t, bool)) {
+    locationChange = _locationChange;
   }
 
 private:
-  uint8_t rawData[8];
-  uint16_t uniqueID;
-  uint16_t address;
-  PacketType type;
-  bool dataReady = false;
-  void (*POMResponse)(RailcomPOMResponse);
+  // The host checks in extras/host hand captures straight to processCapture()
+  friend class RailcomHost;
+
+  // Filled by readData() in the interrupt and drained by processData(). The 
+  // interrupt is the only writer, so it doesn't lock.
+  Queue<RailcomCapture, kRailcomCaptureSlots> captures;
+  volatile uint16_t captureCount = 0;
+  volatile uint16_t captureOverflows = 0;
+  RailcomDecodeStats decodeStats = {};
+  RailcomLinkStats districtStats = {};
+  RailcomLinkStats linkStats[kLinkStatsSlots] = {};
+  // Adds a capture to the district's link quality and the loco's, if the 
+  // packet before the cutout went to a loco
+  void recordLinkStats(const RailcomCapture& capture, 
+    const RailcomSymbols& decoded);
+  static void addLinkStats(RailcomLinkStats& stats, 
+    const RailcomSymbols& decoded);
+  // Decodes a single capture and hands any response to the callbacks
+  void processCapture(RailcomCapture& capture);
+
+  // POM requests waiting for a reply. A null callback marks a free entry.
+  enum POMState : uint8_t {
+    kPOMWaiting,    // Sent, waiting for the reply until the deadline
+    kPOMBackoff,    // Failed, waiting until the deadline to try again
+    kPOMResend      // Waiting for nextPOMResend() to pick it up
+  };
+  struct POMTransaction {
+    uint16_t transmitID;
+    uint16_t address;
+    PacketType type;
+    uint8_t sequence;     // Expected XPOM sequence number
+    POMState state;
+    uint8_t retries;
+    // The last NACK or BUSY, or kPOMTimeout if the decoder hasn't answered
+    RailcomPOMStatus lastStatus;
+    uint32_t deadline;    // millis() when the current state runs out
+    void (*callback)(RailcomPOMResponse);
+  };
+  POMTransaction transactions[kPOMTransactions] = {};
+  // Returns the open transaction a cutout belongs to, or nullptr
+  POMTransaction* findPOM(const RailcomCapture& capture);
+  // Hands a reply to its transaction and closes it
+  void completePOM(const RailcomCapture& capture, 
+    RailcomPOMResponse& response);
+  // Handles ACK, NACK or BUSY in the first byte of channel 2
+  void replyPOM(const RailcomCapture& capture, uint8_t symbol);
+  // Backs a transaction off for a retry, or fails it once it runs out of them
+  void failPOM(POMTransaction& t, RailcomPOMStatus status);
+  // Moves transactions on when their deadlines pass
+  void updatePOM();
+
+  // Open addressing hash table of the loco addresses seen in channel 1, with
+  // linear probing. An address of zero marks a free entry.
+  struct LocationEntry {
+    uint16_t address;
+    uint32_t lastSeen;    // millis() when the address last came in
+  };
+  // Latest logon reply and LOGON_ASSIGN answer, waiting for DCCMain
+  bool logonReplyWaiting = false;
+  uint16_t logonManufacturer = 0;
+  uint32_t logonUniqueID = 0;
+  uint16_t logonAssigned = 0;
+  uint16_t logonCollisions = 0;
+  // Handles the cutout after a DCC-A logon packet. Returns false if the 
+  // capture wasn't for one.
+  bool processLogon(const RailcomCapture& capture, 
+    const RailcomSymbols& decoded);
+
+  RailcomTelemetry telemetry[kTelemetrySlots] = {};
+  void (*telemetryReport)(const RailcomTelemetry&) = nullptr;
+  // Returns the telemetry slot for addr. If there isn't one, and create is 
+  // set, a slot is made for it.
+  RailcomTelemetry* findTelemetry(uint16_t addr, bool create);
+  // Stores the DYN datagrams from channel 2, starting at symbol start
+  void processDynamic(uint16_t addr, const RailcomSymbols& decoded, 
+    uint8_t start);
+  // Reports telemetry that changed or is due for a periodic report
+  void reportTelemetry();
+  // Returns the loco address a multi-function decoder packet went to
+  static uint16_t locoAddress(uint16_t railcomAddr);
+
+  LocationEntry locationTable[kLocationTableSize] = {};
+  uint32_t lastAgeing = 0;
+  void (*locationChange)(uint16_t, bool) = nullptr;
+  // ADR_HIGH half of the channel 1 address, waiting for its ADR_LOW half
+  uint8_t adrHigh = 0;
+  bool adrHighValid = false;
+  uint32_t adrHighTime = 0;   // micros() of the cutout ADR_HIGH came in on
+
+  static uint8_t locationHash(uint16_t addr) { 
+    return (addr ^ (addr >> 4)) & (kLocationTableSize - 1); 
+  }
+  // Returns the index of addr in the location table, or -1
+  int8_t findLocation(uint16_t addr);
+  // Adds addr to the location table, or refreshes it if it's already there
+  void seeLocation(uint16_t addr);
+  // Takes locos that haven't been seen for kLocationTimeout off the table
+  void ageLocations();
+  // Assembles the channel 1 address from its ADR_HIGH and ADR_LOW halves
+  void processAddress(uint8_t identifier, uint8_t payload, uint32_t timestamp);
 
   // Railcom hardware declarations
   uint8_t rx_pin;
@@ -150,6 +444,9 @@ private:
   uint8_t dac_value;      // Sets the DAC according to the calculation 
                           // in the datasheet for a 1V reference
   void setupDAC();       // Enable DAC for LM393 reference
+  // Bytes received during the current cutout, filled by rxInterruptHandler()
+  volatile uint8_t cutoutData[8];
+  volatile uint8_t cutoutBytes = 0;
 #else
   HardwareSerial* serial;
 #endif
@@ -28,7 +28,9 @@ const uint8_t kIdlePacket[] = {0xFF,0x00,0xFF};
 const uint8_t kResetPacket[] = {0x00,0x00,0x00};
 const uint8_t kBitMask[] = {0x00,0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x01};
 
-const uint8_t kPacketMaxSize = 6; 
+// Longest packet including the checksum. An XPOM write of four bytes to a long
+// address takes 11.
+const uint8_t kPacketMaxSize = 11; 
 
 enum : uint8_t {
   ERR_OK = 1,